@@ -0,0 +1,167 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkBlockQuantizedVectorField_h
+#define itkBlockQuantizedVectorField_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkNumericTraits.h"
+#include "itkMultiThreaderBase.h"
+#include <cstdint>
+#include <vector>
+
+namespace itk
+{
+/** \class BlockQuantizedVectorField
+ * \brief Reduced-storage copy of a vector field with 16-bit components.
+ *
+ * The field's buffer is split into blocks of BlockLength consecutive pixels.
+ * Every block stores one scale, which maps the block's largest magnitude
+ * component to the largest 16-bit value, and its components are rounded to
+ * multiples of that scale.  The error introduced is measured when the field
+ * is quantized.
+ *
+ * Blocks are decoded on demand through a DecodeCache, which keeps a few
+ * recently decoded blocks, or all at once with Decode.  A cache is not
+ * thread safe, so it must only be used by one thread at a time.
+ *
+ * \ingroup NDReg
+ */
+template<typename TVectorField>
+class BlockQuantizedVectorField : public Object
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(BlockQuantizedVectorField);
+
+  /** Standard class type alias. */
+  using Self = BlockQuantizedVectorField;
+  using Superclass = Object;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(BlockQuantizedVectorField, Object);
+
+  using VectorFieldType = TVectorField;
+  using VectorType = typename VectorFieldType::PixelType;
+  using ComponentType = typename VectorType::ComponentType;
+  using RegionType = typename VectorFieldType::RegionType;
+  using QuantizedValueType = std::int16_t;
+
+  itkStaticConstMacro(VectorDimension, unsigned int, VectorType::Dimension);
+
+  /** Set/Get the number of pixels per block. Default = 64. */
+  itkSetMacro(BlockLength, SizeValueType);
+  itkGetConstMacro(BlockLength, SizeValueType);
+
+  /** Quantize the buffered region of a field. */
+  void Quantize(const VectorFieldType * field);
+
+  /** Decode a block into values, which must hold BlockLength vectors. */
+  void DecodeBlock(SizeValueType block, VectorType * values) const;
+
+  /** Decode every block into a field whose buffered region matches the
+   * quantized one. */
+  void Decode(VectorFieldType * field) const;
+
+  /** Get the buffered region of the quantized field. */
+  itkGetConstReferenceMacro(BufferedRegion, RegionType);
+  itkGetConstMacro(NumberOfPixels, SizeValueType);
+  SizeValueType GetNumberOfBlocks() const { return m_Scales.size(); }
+
+  /** Get the error introduced by quantization.  The relative error is the
+   * root mean square error divided by the root mean square component. */
+  itkGetConstMacro(MaximumAbsoluteError, double);
+  itkGetConstMacro(RootMeanSquareError, double);
+  itkGetConstMacro(RelativeError, double);
+
+  /** Get the memory used by the quantized values and scales. */
+  SizeValueType GetNumberOfBytes() const
+  {
+    return m_Values.size() * sizeof(QuantizedValueType) + m_Scales.size() * sizeof(double);
+  }
+
+  /** \class DecodeCache
+   * \brief Cache of decoded blocks for use by a single thread.
+   *
+   * Blocks are mapped to entries by their index modulo the number of
+   * entries, which should be prime so that blocks in neighbouring rows and
+   * slices rarely collide.
+   *
+   * \ingroup NDReg
+   */
+  class DecodeCache
+  {
+  public:
+    DecodeCache(const Self * field, unsigned int numberOfEntries = 127) :
+      m_Field(field),
+      m_NumberOfEntries(numberOfEntries),
+      m_Blocks(numberOfEntries, NumericTraits<SizeValueType>::max()),
+      m_Values(numberOfEntries * field->GetBlockLength())
+    {}
+
+    /** Get pixel at offset from start of buffer. */
+    const VectorType & GetPixel(SizeValueType offset)
+    {
+      const SizeValueType blockLength = m_Field->GetBlockLength();
+      const SizeValueType block = offset / blockLength;
+      const SizeValueType entry = block % m_NumberOfEntries;
+      VectorType * values = &m_Values[entry * blockLength];
+      if(m_Blocks[entry] != block)
+      {
+        m_Field->DecodeBlock(block, values);
+        m_Blocks[entry] = block;
+      }
+      return values[offset - block * blockLength];
+    }
+
+  private:
+    const Self *               m_Field;
+    SizeValueType              m_NumberOfEntries;
+    std::vector<SizeValueType> m_Blocks;
+    std::vector<VectorType>    m_Values;
+  };
+
+protected:
+  BlockQuantizedVectorField();
+  ~BlockQuantizedVectorField() override = default;
+
+  void PrintSelf(std::ostream & os, Indent indent) const override;
+
+private:
+
+  SizeValueType                   m_BlockLength;
+  RegionType                      m_BufferedRegion;
+  SizeValueType                   m_NumberOfPixels;
+  std::vector<QuantizedValueType> m_Values;
+  std::vector<double>             m_Scales;
+  double                          m_MaximumAbsoluteError;
+  double                          m_RootMeanSquareError;
+  double                          m_RelativeError;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkBlockQuantizedVectorField.hxx"
+#endif
+
+#endif
@@ -0,0 +1,180 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkBlockQuantizedVectorField_hxx
+#define itkBlockQuantizedVectorField_hxx
+
+#include "itkBlockQuantizedVectorField.h"
+#include "itkMath.h"
+#include <algorithm>
+
+namespace itk
+{
+
+template<typename TVectorField>
+BlockQuantizedVectorField<TVectorField>
+::BlockQuantizedVectorField()
+{
+  m_BlockLength = 64;
+  m_NumberOfPixels = 0;
+  m_MaximumAbsoluteError = 0;
+  m_RootMeanSquareError = 0;
+  m_RelativeError = 0;
+}
+
+template<typename TVectorField>
+void
+BlockQuantizedVectorField<TVectorField>
+::Quantize(const VectorFieldType * field)
+{
+  if(field == nullptr)
+  {
+    itkExceptionMacro("Field is not set.");
+  }
+  if(m_BlockLength == 0)
+  {
+    itkExceptionMacro("BlockLength must be greater than 0.");
+  }
+
+  m_BufferedRegion = field->GetBufferedRegion();
+  m_NumberOfPixels = m_BufferedRegion.GetNumberOfPixels();
+  const SizeValueType numberOfBlocks = (m_NumberOfPixels + m_BlockLength - 1) / m_BlockLength;
+
+  m_Values.resize(m_NumberOfPixels * VectorDimension);
+  m_Scales.resize(numberOfBlocks);
+
+  // Errors are kept per block and reduced afterwards so that they don't depend on thread scheduling
+  std::vector<double> squaredErrors(numberOfBlocks, 0);
+  std::vector<double> squaredValues(numberOfBlocks, 0);
+  std::vector<double> maximumErrors(numberOfBlocks, 0);
+
+  const VectorType * buffer = field->GetBufferPointer();
+  const double maximumQuantizedValue = NumericTraits<QuantizedValueType>::max();
+
+  MultiThreaderBase::Pointer threader = MultiThreaderBase::New();
+  threader->ParallelizeArray(0, numberOfBlocks,
+    [&](SizeValueType block)
+    {
+      const SizeValueType first = block * m_BlockLength;
+      const SizeValueType last = std::min(first + m_BlockLength, m_NumberOfPixels);
+
+      // Map largest magnitude component of block to largest quantized value
+      double maximumValue = 0;
+      for(SizeValueType p = first; p < last; p++)
+      {
+        for(unsigned int c = 0; c < VectorDimension; c++){ maximumValue = std::max(maximumValue, std::abs(static_cast<double>(buffer[p][c]))); }
+      }
+      const double scale = maximumValue / maximumQuantizedValue;
+      m_Scales[block] = scale;
+
+      for(SizeValueType p = first; p < last; p++)
+      {
+        for(unsigned int c = 0; c < VectorDimension; c++)
+        {
+          const double value = buffer[p][c];
+          long quantizedValue = 0;
+          if(scale > 0)
+          {
+            quantizedValue = Math::Round<long>(value / scale);
+            quantizedValue = std::max(-static_cast<long>(maximumQuantizedValue), std::min(static_cast<long>(maximumQuantizedValue), quantizedValue));
+          }
+          m_Values[p * VectorDimension + c] = static_cast<QuantizedValueType>(quantizedValue);
+
+          const double error = std::abs(value - quantizedValue * scale);
+          squaredErrors[block] += error * error;
+          squaredValues[block] += value * value;
+          maximumErrors[block] = std::max(maximumErrors[block], error);
+        }
+      }
+    }, nullptr);
+
+  double sumOfSquaredErrors = 0;
+  double sumOfSquaredValues = 0;
+  m_MaximumAbsoluteError = 0;
+  for(SizeValueType block = 0; block < numberOfBlocks; block++)
+  {
+    sumOfSquaredErrors += squaredErrors[block];
+    sumOfSquaredValues += squaredValues[block];
+    m_MaximumAbsoluteError = std::max(m_MaximumAbsoluteError, maximumErrors[block]);
+  }
+
+  const SizeValueType numberOfValues = m_Values.size();
+  m_RootMeanSquareError = numberOfValues > 0 ? std::sqrt(sumOfSquaredErrors / numberOfValues) : 0;
+  m_RelativeError = sumOfSquaredValues > 0 ? std::sqrt(sumOfSquaredErrors / sumOfSquaredValues) : 0;
+
+  this->Modified();
+}
+
+template<typename TVectorField>
+void
+BlockQuantizedVectorField<TVectorField>
+::DecodeBlock(SizeValueType block, VectorType * values) const
+{
+  const SizeValueType first = block * m_BlockLength;
+  const SizeValueType last = std::min(first + m_BlockLength, m_NumberOfPixels);
+  const double scale = m_Scales[block];
+
+  for(SizeValueType p = first; p < last; p++)
+  {
+    for(unsigned int c = 0; c < VectorDimension; c++)
+    {
+      values[p - first][c] = static_cast<ComponentType>(m_Values[p * VectorDimension + c] * scale);
+    }
+  }
+}
+
+template<typename TVectorField>
+void
+BlockQuantizedVectorField<TVectorField>
+::Decode(VectorFieldType * field) const
+{
+  if(field == nullptr)
+  {
+    itkExceptionMacro("Field is not set.");
+  }
+  if(field->GetBufferedRegion() != m_BufferedRegion)
+  {
+    itkExceptionMacro("Field's buffered region doesn't match the quantized region.");
+  }
+
+  // Blocks are contiguous in the buffer so each one is decoded in place
+  VectorType * buffer = field->GetBufferPointer();
+  MultiThreaderBase::Pointer threader = MultiThreaderBase::New();
+  threader->ParallelizeArray(0, m_Scales.size(),
+    [&](SizeValueType block)
+    {
+      this->DecodeBlock(block, buffer + block * m_BlockLength);
+    }, nullptr);
+}
+
+template<typename TVectorField>
+void
+BlockQuantizedVectorField<TVectorField>
+::PrintSelf(std::ostream & os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+  os << indent << "BlockLength: " << m_BlockLength << std::endl;
+  os << indent << "NumberOfPixels: " << m_NumberOfPixels << std::endl;
+  os << indent << "NumberOfBytes: " << this->GetNumberOfBytes() << std::endl;
+  os << indent << "MaximumAbsoluteError: " << m_MaximumAbsoluteError << std::endl;
+  os << indent << "RootMeanSquareError: " << m_RootMeanSquareError << std::endl;
+  os << indent << "RelativeError: " << m_RelativeError << std::endl;
+}
+
+} // end namespace itk
+
+#endif
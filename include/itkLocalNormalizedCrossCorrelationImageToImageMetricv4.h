@@ -0,0 +1,123 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkLocalNormalizedCrossCorrelationImageToImageMetricv4_h
+#define itkLocalNormalizedCrossCorrelationImageToImageMetricv4_h
+
+#include "itkImageToImageMetricv4.h"
+#include "itkMultiThreaderBase.h"
+#include <vector>
+
+namespace itk
+{
+/** \class LocalNormalizedCrossCorrelationImageToImageMetricv4
+ * \brief Local normalized cross correlation computed with running sums.
+ *
+ * The fixed and moving images are sampled once over the whole virtual
+ * domain. The window sums of f, m, f^2, m^2 and fm are then computed with
+ * separable running sums, so the cost per voxel does not depend on the
+ * window radius.
+ *
+ * The value is -1/N \sum cc(x), where cc(x) is the squared correlation in
+ * the window centered at x. The derivative at x accounts for every window
+ * containing x,
+ * p(x) = \sum_c alpha_c (f(x) - mean_f,c) - beta_c (m(x) - mean_m,c),
+ * with alpha = 2 cov / (var_f var_m) and beta = alpha cov / var_m. The sums
+ * over c are computed with the same running sums as the value. The derivative
+ * is returned as p(x) \nabla m(x), which is -N times the gradient of the value.
+ * Windows whose variance is within the rounding error of the running sums,
+ * relative to the sum of squares, are flat and don't contribute.
+ * Only the six window sums are stored per voxel. The derivative coefficients
+ * reuse four of them, and the images are sampled again for the derivative.
+ * Only moving transforms with local support, such as displacement fields, are
+ * supported by the derivative.
+ *
+ * \ingroup NDReg
+ */
+template<typename TFixedImage, typename TMovingImage, typename TVirtualImage = TFixedImage,
+         typename TInternalComputationValueType = double,
+         typename TMetricTraits = DefaultImageToImageMetricTraitsv4<TFixedImage, TMovingImage, TVirtualImage, TInternalComputationValueType> >
+class LocalNormalizedCrossCorrelationImageToImageMetricv4 :
+  public ImageToImageMetricv4<TFixedImage, TMovingImage, TVirtualImage, TInternalComputationValueType, TMetricTraits>
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(LocalNormalizedCrossCorrelationImageToImageMetricv4);
+
+  /** Standard class type alias. */
+  using Self = LocalNormalizedCrossCorrelationImageToImageMetricv4;
+  using Superclass = ImageToImageMetricv4<TFixedImage, TMovingImage, TVirtualImage, TInternalComputationValueType, TMetricTraits>;
+  using Pointer = SmartPointer<Self>;
+  using ConstPointer = SmartPointer<const Self>;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(LocalNormalizedCrossCorrelationImageToImageMetricv4, ImageToImageMetricv4);
+
+  itkStaticConstMacro(VirtualImageDimension, unsigned int, TVirtualImage::ImageDimension);
+
+  using InternalComputationValueType = TInternalComputationValueType;
+  using MeasureType = typename Superclass::MeasureType;
+  using DerivativeType = typename Superclass::DerivativeType;
+  using DerivativeValueType = typename Superclass::DerivativeValueType;
+
+  using VirtualImageType = typename Superclass::VirtualImageType;
+  using VirtualIndexType = typename Superclass::VirtualIndexType;
+  using VirtualPointType = typename Superclass::VirtualPointType;
+  using VirtualRegionType = typename VirtualImageType::RegionType;
+  using VirtualSizeType = typename VirtualRegionType::SizeType;
+
+  using FixedImagePointType = typename Superclass::FixedImagePointType;
+  using FixedImagePixelType = typename Superclass::FixedImagePixelType;
+  using MovingImagePointType = typename Superclass::MovingImagePointType;
+  using MovingImagePixelType = typename Superclass::MovingImagePixelType;
+  using MovingImageGradientType = typename Superclass::MovingImageGradientType;
+
+  using RadiusType = VirtualSizeType;
+
+  /** Set/Get the radius of the correlation window. Default = 2. */
+  itkSetMacro(Radius, RadiusType);
+  itkGetConstMacro(Radius, RadiusType);
+
+  MeasureType GetValue() const override;
+  void GetDerivative(DerivativeType & derivative) const override;
+  void GetValueAndDerivative(MeasureType & value, DerivativeType & derivative) const override;
+
+  /** Window sums need the whole dense virtual domain. */
+  bool SupportsArbitraryVirtualDomainSamples() const override { return false; }
+
+protected:
+  LocalNormalizedCrossCorrelationImageToImageMetricv4();
+  ~LocalNormalizedCrossCorrelationImageToImageMetricv4() override = default;
+
+  void ComputeValueAndDerivative(MeasureType & value, DerivativeType * derivative) const;
+  void ComputeWindowSums(std::vector<InternalComputationValueType> & sums, SizeValueType numberOfChannels, const VirtualSizeType & size, MultiThreaderBase * threader) const;
+  void PrintSelf(std::ostream & os, Indent indent) const override;
+
+private:
+
+  RadiusType m_Radius;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkLocalNormalizedCrossCorrelationImageToImageMetricv4.hxx"
+#endif
+
+#endif
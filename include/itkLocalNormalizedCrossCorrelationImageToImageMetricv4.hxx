@@ -0,0 +1,325 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkLocalNormalizedCrossCorrelationImageToImageMetricv4_hxx
+#define itkLocalNormalizedCrossCorrelationImageToImageMetricv4_hxx
+
+#include "itkLocalNormalizedCrossCorrelationImageToImageMetricv4.h"
+#include "itkCompensatedSummation.h"
+#include <algorithm>
+#include <mutex>
+
+namespace itk
+{
+
+template<typename TFixedImage, typename TMovingImage, typename TVirtualImage, typename TInternalComputationValueType, typename TMetricTraits>
+LocalNormalizedCrossCorrelationImageToImageMetricv4<TFixedImage, TMovingImage, TVirtualImage, TInternalComputationValueType, TMetricTraits>
+::LocalNormalizedCrossCorrelationImageToImageMetricv4()
+{
+  m_Radius.Fill(2);
+}
+
+template<typename TFixedImage, typename TMovingImage, typename TVirtualImage, typename TInternalComputationValueType, typename TMetricTraits>
+typename LocalNormalizedCrossCorrelationImageToImageMetricv4<TFixedImage, TMovingImage, TVirtualImage, TInternalComputationValueType, TMetricTraits>::MeasureType
+LocalNormalizedCrossCorrelationImageToImageMetricv4<TFixedImage, TMovingImage, TVirtualImage, TInternalComputationValueType, TMetricTraits>
+::GetValue() const
+{
+  MeasureType value;
+  this->ComputeValueAndDerivative(value, nullptr);
+  return value;
+}
+
+template<typename TFixedImage, typename TMovingImage, typename TVirtualImage, typename TInternalComputationValueType, typename TMetricTraits>
+void
+LocalNormalizedCrossCorrelationImageToImageMetricv4<TFixedImage, TMovingImage, TVirtualImage, TInternalComputationValueType, TMetricTraits>
+::GetDerivative(DerivativeType & derivative) const
+{
+  MeasureType value;
+  this->ComputeValueAndDerivative(value, &derivative);
+}
+
+template<typename TFixedImage, typename TMovingImage, typename TVirtualImage, typename TInternalComputationValueType, typename TMetricTraits>
+void
+LocalNormalizedCrossCorrelationImageToImageMetricv4<TFixedImage, TMovingImage, TVirtualImage, TInternalComputationValueType, TMetricTraits>
+::GetValueAndDerivative(MeasureType & value, DerivativeType & derivative) const
+{
+  this->ComputeValueAndDerivative(value, &derivative);
+}
+
+template<typename TFixedImage, typename TMovingImage, typename TVirtualImage, typename TInternalComputationValueType, typename TMetricTraits>
+void
+LocalNormalizedCrossCorrelationImageToImageMetricv4<TFixedImage, TMovingImage, TVirtualImage, TInternalComputationValueType, TMetricTraits>
+::ComputeWindowSums(std::vector<InternalComputationValueType> & sums, SizeValueType numberOfChannels, const VirtualSizeType & size, MultiThreaderBase * threader) const
+{
+  SizeValueType numberOfPixels = 1;
+  for(unsigned int d = 0; d < VirtualImageDimension; d++){ numberOfPixels *= size[d]; }
+
+  // Box filter is separable so sum along one dimension at a time
+  SizeValueType stride = 1;
+  for(unsigned int d = 0; d < VirtualImageDimension; d++)
+  {
+    const SizeValueType length = size[d];
+    const SizeValueType radius = m_Radius[d];
+    const SizeValueType numberOfLines = numberOfPixels / length;
+
+    if(radius > 0)
+    {
+      threader->ParallelizeArray(0, numberOfChannels * numberOfLines,
+        [&](SizeValueType line)
+        {
+          const SizeValueType channel = line / numberOfLines;
+          const SizeValueType lineInChannel = line % numberOfLines;
+          InternalComputationValueType * data = sums.data() + channel * numberOfPixels + (lineInChannel % stride) + (lineInChannel / stride) * stride * length;
+
+          std::vector<InternalComputationValueType> values(length);
+          for(SizeValueType k = 0; k < length; k++){ values[k] = data[k * stride]; }
+
+          // Slide window [k - r, k + r] along line, adding and removing one value per step
+          InternalComputationValueType windowSum = 0;
+          for(SizeValueType k = 0; k < length && k <= radius; k++){ windowSum += values[k]; }
+          for(SizeValueType k = 0; k < length; k++)
+          {
+            data[k * stride] = windowSum;
+            if(k + radius + 1 < length){ windowSum += values[k + radius + 1]; }
+            if(k >= radius){ windowSum -= values[k - radius]; }
+          }
+        }, nullptr);
+    }
+
+    stride *= length;
+  }
+}
+
+template<typename TFixedImage, typename TMovingImage, typename TVirtualImage, typename TInternalComputationValueType, typename TMetricTraits>
+void
+LocalNormalizedCrossCorrelationImageToImageMetricv4<TFixedImage, TMovingImage, TVirtualImage, TInternalComputationValueType, TMetricTraits>
+::ComputeValueAndDerivative(MeasureType & value, DerivativeType * derivative) const
+{
+  if(derivative && (!this->HasLocalSupport() || this->GetNumberOfLocalParameters() != VirtualImageDimension))
+  {
+    itkExceptionMacro("Derivative requires a moving transform with local support, such as a displacement field.");
+  }
+
+  const VirtualRegionType  region = this->GetVirtualRegion();
+  const VirtualSizeType    size = region.GetSize();
+  const SizeValueType      numberOfPixels = region.GetNumberOfPixels();
+  const VirtualImageType * virtualImage = this->GetVirtualImage();
+
+  // Buffers are laid out in the order of the virtual region
+  OffsetValueType strides[VirtualImageDimension];
+  strides[0] = 1;
+  for(unsigned int d = 1; d < VirtualImageDimension; d++){ strides[d] = strides[d-1] * size[d-1]; }
+
+  // Index of the n-th voxel of a subregion and its offset in the buffers
+  auto getIndexAndOffset = [&](const VirtualRegionType & subregion, SizeValueType n, VirtualIndexType & index)
+    {
+      index = subregion.GetIndex();
+      OffsetValueType offset = 0;
+      for(unsigned int d = 0; d < VirtualImageDimension; d++)
+      {
+        index[d] += n % subregion.GetSize()[d];
+        n /= subregion.GetSize()[d];
+        offset += (index[d] - region.GetIndex()[d]) * strides[d];
+      }
+      return offset;
+    };
+
+  // Channels are 1, f, m, f^2, m^2 and fm.
+  // The first four are reused for the derivative coefficients once the correlation is known.
+  const SizeValueType numberOfChannels = 6;
+  std::vector<InternalComputationValueType> sums(numberOfChannels * numberOfPixels, 0);
+  std::vector<unsigned char>                isValid(numberOfPixels, 0);
+
+  MultiThreaderBase::Pointer threader = MultiThreaderBase::New();
+
+  // Sample images once over the virtual domain
+  threader->ParallelizeImageRegion<VirtualImageDimension>(region,
+    [&](const VirtualRegionType & subregion)
+    {
+      const SizeValueType numberOfSubregionPixels = subregion.GetNumberOfPixels();
+      for(SizeValueType n = 0; n < numberOfSubregionPixels; n++)
+      {
+        VirtualIndexType index;
+        const OffsetValueType offset = getIndexAndOffset(subregion, n, index);
+
+        VirtualPointType virtualPoint;
+        virtualImage->TransformIndexToPhysicalPoint(index, virtualPoint);
+
+        FixedImagePointType  mappedFixedPoint;
+        FixedImagePixelType  fixedValue;
+        MovingImagePointType mappedMovingPoint;
+        MovingImagePixelType movingValue;
+        if(!this->TransformAndEvaluateFixedPoint(virtualPoint, mappedFixedPoint, fixedValue)){ continue; }
+        if(!this->TransformAndEvaluateMovingPoint(virtualPoint, mappedMovingPoint, movingValue)){ continue; }
+
+        const InternalComputationValueType f = fixedValue;
+        const InternalComputationValueType m = movingValue;
+        isValid[offset] = 1;
+        sums[offset] = 1;
+        sums[1 * numberOfPixels + offset] = f;
+        sums[2 * numberOfPixels + offset] = m;
+        sums[3 * numberOfPixels + offset] = f * f;
+        sums[4 * numberOfPixels + offset] = m * m;
+        sums[5 * numberOfPixels + offset] = f * m;
+      }
+    }, nullptr);
+
+  // Sum each channel over the window centered at every voxel
+  this->ComputeWindowSums(sums, numberOfChannels, size, threader);
+
+  if(derivative)
+  {
+    if(derivative->GetSize() != this->GetNumberOfParameters()){ derivative->SetSize(this->GetNumberOfParameters()); }
+    derivative->Fill(NumericTraits<DerivativeValueType>::ZeroValue());
+  }
+
+  // Compute correlation and the derivative coefficients from the window sums.
+  // Each voxel only reads its own sums, so its coefficients alpha, alpha mean_f, beta and beta mean_m
+  // replace the sums of 1, f, m and f^2 in place.
+  CompensatedSummation<InternalComputationValueType> correlationSum;
+  SizeValueType numberOfValidPoints = 0;
+  std::mutex    mutex;
+
+  const SizeValueType numberOfChunks = std::min<SizeValueType>(numberOfPixels, 1024);
+  threader->ParallelizeArray(0, numberOfChunks,
+    [&](SizeValueType chunk)
+    {
+      CompensatedSummation<InternalComputationValueType> localCorrelationSum;
+      SizeValueType localNumberOfValidPoints = 0;
+
+      const SizeValueType first = chunk * numberOfPixels / numberOfChunks;
+      const SizeValueType last = (chunk + 1) * numberOfPixels / numberOfChunks;
+      for(SizeValueType offset = first; offset < last; offset++)
+      {
+        const InternalComputationValueType n = sums[offset];
+        const InternalComputationValueType sumF = sums[1 * numberOfPixels + offset];
+        const InternalComputationValueType sumM = sums[2 * numberOfPixels + offset];
+        const InternalComputationValueType sumFF = sums[3 * numberOfPixels + offset];
+        const InternalComputationValueType sumMM = sums[4 * numberOfPixels + offset];
+        const InternalComputationValueType sumFM = sums[5 * numberOfPixels + offset];
+
+        InternalComputationValueType alpha = 0;
+        InternalComputationValueType beta = 0;
+        InternalComputationValueType meanF = 0;
+        InternalComputationValueType meanM = 0;
+        if(isValid[offset])
+        {
+          localNumberOfValidPoints++;
+
+          meanF = sumF / n;
+          meanM = sumM / n;
+          const InternalComputationValueType varianceF = sumFF - sumF * meanF;
+          const InternalComputationValueType varianceM = sumMM - sumM * meanM;
+          const InternalComputationValueType covariance = sumFM - sumF * meanM;
+
+          // Correlation is undefined in flat windows.
+          // Variances within the rounding error of the running sums, relative to the sums of squares, are flat.
+          const InternalComputationValueType tolerance = n * NumericTraits<InternalComputationValueType>::epsilon();
+          if(varianceF > tolerance * sumFF && varianceM > tolerance * sumMM)
+          {
+            const InternalComputationValueType varianceProduct = varianceF * varianceM;
+            localCorrelationSum += covariance * covariance / varianceProduct; // cc
+
+            // d cc / dm(y) = alpha (f(y) - mean_f) - beta (m(y) - mean_m) for every y in the window
+            alpha = 2.0 * covariance / varianceProduct; // 2 cov / (var_f var_m)
+            beta = alpha * covariance / varianceM;      // 2 cov^2 / (var_f var_m^2)
+          }
+        }
+
+        if(derivative)
+        {
+          sums[offset] = alpha;
+          sums[1 * numberOfPixels + offset] = alpha * meanF;
+          sums[2 * numberOfPixels + offset] = beta;
+          sums[3 * numberOfPixels + offset] = beta * meanM;
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      correlationSum += localCorrelationSum.GetSum();
+      numberOfValidPoints += localNumberOfValidPoints;
+    }, nullptr);
+
+  if(derivative)
+  {
+    // Windows containing x are those centered within the radius of x, so their coefficients are summed with the same box filter
+    const SizeValueType numberOfCoefficients = 4;
+    this->ComputeWindowSums(sums, numberOfCoefficients, size, threader);
+
+    // Images are sampled again rather than kept, which would need 2 + D more values per voxel
+    threader->ParallelizeImageRegion<VirtualImageDimension>(region,
+      [&](const VirtualRegionType & subregion)
+      {
+        const SizeValueType numberOfSubregionPixels = subregion.GetNumberOfPixels();
+        for(SizeValueType n = 0; n < numberOfSubregionPixels; n++)
+        {
+          VirtualIndexType index;
+          const OffsetValueType offset = getIndexAndOffset(subregion, n, index);
+          if(!isValid[offset]){ continue; }
+
+          VirtualPointType virtualPoint;
+          virtualImage->TransformIndexToPhysicalPoint(index, virtualPoint);
+
+          FixedImagePointType  mappedFixedPoint;
+          FixedImagePixelType  fixedValue;
+          MovingImagePointType mappedMovingPoint;
+          MovingImagePixelType movingValue;
+          this->TransformAndEvaluateFixedPoint(virtualPoint, mappedFixedPoint, fixedValue);
+          this->TransformAndEvaluateMovingPoint(virtualPoint, mappedMovingPoint, movingValue);
+
+          MovingImageGradientType movingGradient;
+          this->ComputeMovingImageGradientAtPoint(mappedMovingPoint, movingGradient);
+
+          // p = \sum alpha f - \sum alpha mean_f - \sum beta m + \sum beta mean_m
+          const InternalComputationValueType f = fixedValue;
+          const InternalComputationValueType m = movingValue;
+          const InternalComputationValueType p =
+            f * sums[offset] - sums[1 * numberOfPixels + offset] -
+            m * sums[2 * numberOfPixels + offset] + sums[3 * numberOfPixels + offset];
+          for(unsigned int i = 0; i < VirtualImageDimension; i++)
+          {
+            (*derivative)[offset * VirtualImageDimension + i] = p * movingGradient[i]; // p \nabla m
+          }
+        }
+      }, nullptr);
+  }
+
+  this->m_NumberOfValidPoints = numberOfValidPoints;
+  if(numberOfValidPoints == 0)
+  {
+    itkWarningMacro("No valid points were found in the virtual domain.");
+    value = NumericTraits<MeasureType>::max();
+  }
+  else
+  {
+    value = -correlationSum.GetSum() / numberOfValidPoints; // -1/N \sum cc
+  }
+  this->m_Value = value;
+}
+
+template<typename TFixedImage, typename TMovingImage, typename TVirtualImage, typename TInternalComputationValueType, typename TMetricTraits>
+void
+LocalNormalizedCrossCorrelationImageToImageMetricv4<TFixedImage, TMovingImage, TVirtualImage, TInternalComputationValueType, TMetricTraits>
+::PrintSelf(std::ostream & os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+  os << indent << "Radius: " << m_Radius << std::endl;
+}
+
+} // end namespace itk
+
+#endif
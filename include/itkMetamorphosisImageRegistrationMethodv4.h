@@ -24,21 +24,38 @@
 #include "itkInverseFFTImageFilter.h"
 #include "itkFFTPadImageFilter.h"
 #include "itkMeanSquaresImageToImageMetricv4.h"
+#include "itkLocalNormalizedCrossCorrelationImageToImageMetricv4.h"
 #include "itkImportImageFilter.h"
 #include "itkComposeImageFilter.h"
 #include "itkVectorIndexSelectionCastImageFilter.h"
 #include "itkVectorMagnitudeImageFilter.h"
 #include "itkGradientImageFilter.h"
 #include "itkDisplacementFieldJacobianDeterminantFilter.h"
+#include "itkExpImageFilter.h"
 #include "itkStatisticsImageFilter.h"
 #include "itkAddImageFilter.h"
 #include "itkMultiplyImageFilter.h"
 #include "itkJoinSeriesImageFilter.h"
 #include "itkExtractImageFilter.h"
 #include "itkWrapExtrapolateImageFunction.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkVectorLinearInterpolateImageFunction.h"
 #include "itkNearestNeighborInterpolateImageFunction.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkMultiThreaderBase.h"
 #include "itkImageMaskSpatialObject.h"
 #include "itkSpatialObjectToImageFilter.h"
+#include "itkRealTimeClock.h"
+#include "itkCompensatedSummation.h"
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace itk
 {
@@ -152,12 +169,23 @@ public:
   using FieldPointer = typename FieldType::Pointer;
   using VectorType = typename FieldType::PixelType;
 
+  using LogJacobianDeterminantImageType = typename OutputTransformType::ScalarFieldType;
+  using LogJacobianDeterminantImagePointer = typename LogJacobianDeterminantImageType::Pointer;
+
   using TimeVaryingImageType = Image<typename VirtualImageType::PixelType,ImageDimension+1>;
   using TimeVaryingImagePointer = typename TimeVaryingImageType::Pointer;
 
   using TimeVaryingFieldType = typename OutputTransformType::TimeVaryingVelocityFieldType;
   using TimeVaryingFieldPointer = typename TimeVaryingFieldType::Pointer;
 
+  using QuantizedTimeVaryingFieldType = typename OutputTransformType::QuantizedVelocityFieldType;
+  using QuantizedTimeVaryingFieldPointer = typename QuantizedTimeVaryingFieldType::Pointer;
+
+  using ComplexTimeVaryingImageType = typename ForwardFFTImageFilter<TimeVaryingImageType>::OutputImageType;
+  using ComplexTimeVaryingImagePointer = typename ComplexTimeVaryingImageType::Pointer;
+  using VelocityBandType = FixedArray<ComplexTimeVaryingImagePointer, ImageDimension>;
+  using VelocityBandBlockType = std::pair<typename TimeVaryingImageType::RegionType, typename TimeVaryingImageType::RegionType>; // Band and spectrum regions
+
   // Metric type alias
   using ImageMetricType = typename Superclass::ImageMetricType;
   using ImageMetricPointer = typename ImageMetricType::Pointer;
@@ -197,6 +225,15 @@ public:
   itkGetConstMacro(NumberOfTimeSteps, unsigned int);
   itkSetMacro(NumberOfIterations, unsigned int);
   itkGetConstMacro(NumberOfIterations, unsigned int);
+
+  /** Maximum wall-clock time of a run in seconds, including initialization. Zero means no limit.
+   * Convergence is also declared when the relative decrease of the energy
+   * over the last ConvergenceWindowSize iterations is below
+   * ConvergenceThreshold. */
+  itkSetMacro(MaximumElapsedTime, double);
+  itkGetConstMacro(MaximumElapsedTime, double);
+  itkGetConstMacro(ElapsedTime, double);
+  itkGetConstMacro(StopConditionDescription, std::string);
   itkBooleanMacro(UseJacobian);
   itkSetMacro(UseJacobian, bool);
   itkGetConstMacro(UseJacobian, bool);
@@ -204,6 +241,63 @@ public:
   itkSetMacro(UseBias, bool);
   itkGetConstMacro(UseBias, bool);
 
+  /** Optimize only a truncated low-frequency spectrum of the velocity.
+   * VelocityBandFraction is the fraction of each spatial dimension's
+   * frequencies which are kept.  The band is smaller than the velocity by
+   * about VelocityBandFraction^d, and only the band is kept for a rejected
+   * step.  In exchange, every gradient evaluation takes a forward FFT of each
+   * velocity gradient component and every trial step an inverse FFT of each
+   * velocity component, where the dense parameterization only applies the
+   * kernel.  The dense velocity is still synthesized for integration, so the
+   * band saves memory and iterations on smooth problems rather than time per
+   * iteration. */
+  itkBooleanMacro(UseBandLimitedVelocity);
+  itkSetMacro(UseBandLimitedVelocity, bool);
+  itkGetConstMacro(UseBandLimitedVelocity, bool);
+  itkSetClampMacro(VelocityBandFraction, double, 0.0, 1.0);
+  itkGetConstMacro(VelocityBandFraction, double);
+
+  /** Optimize only the initial momentum, p_0.
+   * The velocity is generated from it by geodesic shooting.
+   * The momentum gradient is approximate: the velocity gradient is pulled back
+   * along the current maps, which are held fixed, so it isn't the exact
+   * adjoint of shooting.  Shooting doesn't generate the rate, so UseBias is
+   * turned off with a warning.  Can't be combined with UseBandLimitedVelocity. */
+  itkBooleanMacro(UseGeodesicShooting);
+  itkSetMacro(UseGeodesicShooting, bool);
+  itkGetConstMacro(UseGeodesicShooting, bool);
+  itkGetModifiableObjectMacro(InitialMomentum, VirtualImageType);
+
+  /** Pad the velocity grid to the sizes the active FFT backend runs fastest
+   * on, instead of the smallest sizes with small prime factors. Each spatial
+   * dimension may grow by at most MaximumPaddingFraction of its size, unless
+   * no admissible size fits. The time dimension always gets its smallest
+   * admissible size. Admissible sizes have no prime factor greater than 5 or
+   * than the backend supports, as without autotuning. Tuned sizes are cached
+   * in FFTSizeCacheFileName, if set, and reused for grids of the same shape.
+   * The cache is rewritten through a temporary file which is renamed over it,
+   * and entries which can't be parsed are skipped. */
+  itkBooleanMacro(UseFFTSizeAutotuning);
+  itkSetMacro(UseFFTSizeAutotuning, bool);
+  itkGetConstMacro(UseFFTSizeAutotuning, bool);
+  itkSetClampMacro(MaximumPaddingFraction, double, 0.0, NumericTraits<double>::max());
+  itkGetConstMacro(MaximumPaddingFraction, double);
+  itkSetStringMacro(FFTSizeCacheFileName);
+  itkGetStringMacro(FFTSizeCacheFileName);
+
+  /** Integrate 16-bit block-quantized copies of the velocity during
+   * optimization.  This trades accuracy for memory bandwidth in the
+   * integrator only: the quantized copy is held alongside the full-precision
+   * velocity, so the memory footprint grows slightly.  The controls, the
+   * gradients and the accepted state stay at full precision, and the final
+   * transform is integrated at full precision.  GetVelocityQuantizationError
+   * returns the relative root mean square error of the last quantized
+   * velocity. */
+  itkBooleanMacro(UseQuantizedVelocity);
+  itkSetMacro(UseQuantizedVelocity, bool);
+  itkGetConstMacro(UseQuantizedVelocity, bool);
+  double GetVelocityQuantizationError() const;
+
   double GetVelocityEnergy();
   double GetRateEnergy();
   double GetImageEnergy(VirtualImagePointer movingImage, MaskPointer movingMask=nullptr);
@@ -213,17 +307,50 @@ public:
   double GetLength();
   BiasImagePointer GetBias();
 
+  /** Request that optimization stops, keeping the last accepted controls.
+   * May be called from an observer or from another thread.  A request made
+   * before Update() stops that run before the first iteration.  The request
+   * is cleared when the run ends. */
+  void StopOptimization();
+
 protected:
   MetamorphosisImageRegistrationMethodv4();
   ~MetamorphosisImageRegistrationMethodv4() override = default;
+  template<typename TImage> typename TImage::Pointer ApplyKernelToImage(TImage * kernel, TImage * image);
+  template<typename TImage, typename TField> typename TField::Pointer ApplyKernelToField(TImage * kernel, TField * field);
   TimeVaryingImagePointer ApplyKernel(TimeVaryingImagePointer kernel, TimeVaryingImagePointer image);
   TimeVaryingFieldPointer ApplyKernel(TimeVaryingImagePointer kernel, TimeVaryingFieldPointer image);
-  double CalculateNorm(TimeVaryingImagePointer image);
-  double CalculateNorm(TimeVaryingFieldPointer field);
+  VirtualImagePointer ApplyKernel(VirtualImagePointer kernel, VirtualImagePointer image);
+  FieldPointer ApplyKernel(VirtualImagePointer kernel, FieldPointer field);
+  template<typename TImage> std::vector<double> CalculateSliceSumsOfSquares(const TImage * image);
+  template<typename TValue> static double SquaredNorm(const TValue & value){ return static_cast<double>(value) * value; }
+  template<typename TValue, unsigned int VLength> static double SquaredNorm(const Vector<TValue, VLength> & value){ return value.GetSquaredNorm(); }
+  template<typename TImage> double CalculateNorm(const SmartPointer<TImage> & image);
+  double CalculateNorm(const VelocityBandType & band, TimeVaryingImagePointer kernel);
+  void InitializeVelocityBand();
+  std::vector<VelocityBandBlockType> GetVelocityBandBlocks(const typename TimeVaryingImageType::RegionType & frequencyRegion) const;
+  ComplexTimeVaryingImagePointer ProjectOntoVelocityBand(TimeVaryingImagePointer image);
+  VelocityBandType ProjectOntoVelocityBand(TimeVaryingFieldPointer field);
+  TimeVaryingImagePointer SynthesizeFromVelocityBand(ComplexTimeVaryingImagePointer band);
+  TimeVaryingFieldPointer SynthesizeFromVelocityBand(const VelocityBandType & band);
+  VelocityBandType CombineVelocityBands(const VelocityBandType & band0, const VelocityBandType & band1, double scale, TimeVaryingImagePointer kernel = nullptr);
+  unsigned int GetFFTSizeGreatestPrimeFactor() const;
+  typename TimeVaryingImageType::SizeType AutotuneFFTSize(const typename TimeVaryingImageType::SizeType & size);
   void InitializeKernels(TimeVaryingImagePointer kernel, TimeVaryingImagePointer inverseKernel, double alpha, double gamma);
   void Initialize();
   void IntegrateRate();
+  template<typename TTimeVaryingImage, typename TImage> typename TImage::Pointer ExtractSliceFromImage(TTimeVaryingImage * image, unsigned int j);
+  VirtualImagePointer ExtractSlice(TimeVaryingImagePointer image, unsigned int j);
+  FieldPointer ExtractSlice(TimeVaryingFieldPointer field, unsigned int j);
+  FieldPointer IntegrateTimeStep(FieldPointer velocity, double timeStep, LogJacobianDeterminantImagePointer * logJacobianDeterminant = nullptr);
+  void Shoot();
+  void WarpForward(FieldPointer field);
+  void SaveState();
+  void RestoreState();
+  VirtualImagePointer GetJacobianDeterminant(FieldPointer field);
   FieldPointer GetMetricDerivative(FieldPointer field, bool useImageGradients);
+  FieldPointer TransportMetricDerivative(FieldPointer metricDerivative, FieldPointer field, bool useImageGradients);
+  bool IsStopRequested();
   void UpdateControls();
   void StartOptimization() override;
   void GenerateData() override;
@@ -231,6 +358,24 @@ protected:
 
 private:
 
+  /** Controls, derived fields and energies of the last accepted iterate */
+  struct AcceptedStateType
+  {
+    TimeVaryingFieldPointer velocity;
+    TimeVaryingImagePointer rate;
+    VelocityBandType        velocityBand;
+    VirtualImagePointer     initialMomentum;
+    FieldPointer            displacementField;
+    FieldPointer            inverseDisplacementField;
+    BiasImagePointer        bias;
+    VirtualImagePointer     forwardImage;
+    MaskImagePointer        forwardMaskImage;
+    double                  velocityEnergy;
+    double                  rateEnergy;
+    double                  imageEnergy;
+    double                  energy;
+  };
+
   double m_Scale;
   double m_RegistrationSmoothness;
   double m_BiasSmoothness;
@@ -243,12 +388,29 @@ private:
   double m_MinImageEnergy;
   unsigned int m_NumberOfTimeSteps;
   unsigned int m_NumberOfIterations;
+  double m_MaximumElapsedTime;
+  double m_ElapsedTime;
+  double m_StartTime;
+  std::atomic<bool> m_StopRequested;
+  std::string m_StopConditionDescription;
+  RealTimeClock::Pointer m_Clock;
   bool m_UseJacobian;
   bool m_UseBias;
+  bool m_UseBandLimitedVelocity;
+  double m_VelocityBandFraction;
+  bool m_UseGeodesicShooting;
+  bool m_UseFFTSizeAutotuning;
+  bool m_UseQuantizedVelocity;
+  double m_MaximumPaddingFraction;
+  std::string m_FFTSizeCacheFileName;
   double m_TimeStep;
   double m_VoxelVolume;
   double m_Energy;
+  double m_VelocityEnergy;
+  double m_RateEnergy;
+  double m_ImageEnergy;
   bool m_RecalculateEnergy;
+  AcceptedStateType m_AcceptedState;
   bool m_IsConverged;
   VirtualImagePointer m_VirtualImage;
   VirtualImagePointer m_ForwardImage;
@@ -261,6 +423,11 @@ private:
   TimeVaryingImagePointer m_InverseRateKernel;
   TimeVaryingImagePointer m_Rate;
   VirtualImagePointer m_Bias;
+  typename TimeVaryingImageType::RegionType m_VelocityBandRegion;
+  VelocityBandType m_VelocityBand;
+  VirtualImagePointer m_SpatialVelocityKernel;
+  VirtualImagePointer m_InitialMomentum;
+  TimeVaryingImagePointer m_ImageTrajectory;
 
   typename MovingImageConstantGradientFilterType::Pointer m_MovingImageConstantGradientFilter;
   typename FixedImageConstantGradientFilterType::Pointer  m_FixedImageConstantGradientFilter;
@@ -39,8 +39,26 @@ MetamorphosisImageRegistrationMethodv4()
   m_MaxImageEnergy = 0;
   m_NumberOfTimeSteps = 10;           // 4
   m_NumberOfIterations = 100;         // 20
+  m_MaximumElapsedTime = 0;           // No limit
+  m_ElapsedTime = 0;
+  m_StartTime = 0;
+  m_StopRequested = false;
+  m_Clock = RealTimeClock::New();
+  this->SetConvergenceThreshold(0);   // No windowed convergence check
+  this->SetConvergenceWindowSize(10);
   m_UseJacobian = true;
   m_UseBias = true;
+  m_UseBandLimitedVelocity = false;
+  m_VelocityBandFraction = 0.25;
+  m_UseGeodesicShooting = false;
+  m_UseFFTSizeAutotuning = false;
+  m_UseQuantizedVelocity = false;
+  m_MaximumPaddingFraction = 0.25;
+  m_FFTSizeCacheFileName = "";
+  m_Energy = 0;
+  m_VelocityEnergy = 0;
+  m_RateEnergy = 0;
+  m_ImageEnergy = 0;
   m_RecalculateEnergy = true;
   this->m_CurrentIteration = 0;
   this->m_IsConverged = false;
@@ -65,24 +83,25 @@ MetamorphosisImageRegistrationMethodv4()
 }
 
 template<typename TFixedImage, typename TMovingImage>
-typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::TimeVaryingImagePointer
+template<typename TImage>
+typename TImage::Pointer
 MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
-ApplyKernel(TimeVaryingImagePointer kernel, TimeVaryingImagePointer image)
+ApplyKernelToImage(TImage * kernel, TImage * image)
 {
   // Calculate the Fourier transform of image.
-  using FFTType = ForwardFFTImageFilter<TimeVaryingImageType>;
+  using FFTType = ForwardFFTImageFilter<TImage>;
   typename FFTType::Pointer                     fft = FFTType::New();
   fft->SetInput(image);
 
   //...multiply it by the kernel...
   using ComplexImageType = typename FFTType::OutputImageType;
-  using ComplexImageMultiplierType = MultiplyImageFilter<ComplexImageType,TimeVaryingImageType,ComplexImageType>;
+  using ComplexImageMultiplierType = MultiplyImageFilter<ComplexImageType,TImage,ComplexImageType>;
   typename ComplexImageMultiplierType::Pointer  multiplier = ComplexImageMultiplierType::New();
   multiplier->SetInput1(fft->GetOutput());    // Fourier-Transform of image
   multiplier->SetInput2(kernel);      // Kernel
 
   // ...and finaly take the inverse Fourier transform.
-  using IFFTType = InverseFFTImageFilter<ComplexImageType,TimeVaryingImageType>;
+  using IFFTType = InverseFFTImageFilter<ComplexImageType,TImage>;
   typename IFFTType::Pointer                    ifft = IFFTType::New();
   ifft->SetInput(multiplier->GetOutput());
   ifft->Update();
@@ -91,29 +110,62 @@ ApplyKernel(TimeVaryingImagePointer kernel, TimeVaryingImagePointer image)
 }
 
 template<typename TFixedImage, typename TMovingImage>
-typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::TimeVaryingFieldPointer
+template<typename TImage, typename TField>
+typename TField::Pointer
 MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
-ApplyKernel(TimeVaryingImagePointer kernel, TimeVaryingFieldPointer field)
+ApplyKernelToField(TImage * kernel, TField * field)
 {
   // Apply kernel to each component of field
-  using ComponentComposerType = ComposeImageFilter<TimeVaryingImageType,TimeVaryingFieldType>;
+  using ComponentComposerType = ComposeImageFilter<TImage,TField>;
   typename ComponentComposerType::Pointer   componentComposer = ComponentComposerType::New();
 
   for(unsigned int i = 0; i < ImageDimension; i++)
   {
-    using ComponentExtractorType = VectorIndexSelectionCastImageFilter<TimeVaryingFieldType,TimeVaryingImageType>;
+    using ComponentExtractorType = VectorIndexSelectionCastImageFilter<TField,TImage>;
     typename ComponentExtractorType::Pointer      componentExtractor = ComponentExtractorType::New();
     componentExtractor->SetInput(field);
     componentExtractor->SetIndex(i);
     componentExtractor->Update();
 
-    componentComposer->SetInput(i,ApplyKernel(kernel,componentExtractor->GetOutput()));
+    componentComposer->SetInput(i,ApplyKernelToImage<TImage>(kernel,componentExtractor->GetOutput()));
   }
   componentComposer->Update();
 
   return componentComposer->GetOutput();
 }
 
+template<typename TFixedImage, typename TMovingImage>
+typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::TimeVaryingImagePointer
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+ApplyKernel(TimeVaryingImagePointer kernel, TimeVaryingImagePointer image)
+{
+  return ApplyKernelToImage<TimeVaryingImageType>(kernel, image);
+}
+
+template<typename TFixedImage, typename TMovingImage>
+typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::TimeVaryingFieldPointer
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+ApplyKernel(TimeVaryingImagePointer kernel, TimeVaryingFieldPointer field)
+{
+  return ApplyKernelToField<TimeVaryingImageType,TimeVaryingFieldType>(kernel, field);
+}
+
+template<typename TFixedImage, typename TMovingImage>
+typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::VirtualImagePointer
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+ApplyKernel(VirtualImagePointer kernel, VirtualImagePointer image)
+{
+  return ApplyKernelToImage<VirtualImageType>(kernel, image);
+}
+
+template<typename TFixedImage, typename TMovingImage>
+typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::FieldPointer
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+ApplyKernel(VirtualImagePointer kernel, FieldPointer field)
+{
+  return ApplyKernelToField<VirtualImageType,FieldType>(kernel, field);
+}
+
 template<typename TFixedImage, typename TMovingImage>
 void
 MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
@@ -158,11 +210,379 @@ InitializeKernels(TimeVaryingImagePointer kernel, TimeVaryingImagePointer invers
 }
 
 
+template<typename TFixedImage, typename TMovingImage>
+void
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+InitializeVelocityBand()
+{
+  TimeVaryingFieldPointer velocity = this->m_OutputTransform->GetVelocityField();
+  typename TimeVaryingImageType::SizeType size = velocity->GetLargestPossibleRegion().GetSize();
+
+  // Keep all temporal frequencies but only the lowest spatial frequencies of each time slice
+  typename TimeVaryingImageType::SizeType bandSize = size;
+  for(unsigned int i = 0; i < ImageDimension; i++)
+  {
+    // Nyquist frequency is excluded so that band stays Hermitian symmetric
+    SizeValueType radius = static_cast<SizeValueType>(m_VelocityBandFraction * size[i] / 2.0);
+    radius = std::min(radius, (size[i] - 1) / 2);
+    bandSize[i] = 2 * radius + 1;
+  }
+
+  typename TimeVaryingImageType::IndexType bandIndex;
+  bandIndex.Fill(0);
+  m_VelocityBandRegion.SetIndex(bandIndex);
+  m_VelocityBandRegion.SetSize(bandSize);
+
+  // Initialize velocity spectrum, \hat{v} = 0
+  for(unsigned int i = 0; i < ImageDimension; i++)
+  {
+    m_VelocityBand[i] = ComplexTimeVaryingImageType::New();
+    m_VelocityBand[i]->SetRegions(m_VelocityBandRegion);
+    m_VelocityBand[i]->Allocate();
+    m_VelocityBand[i]->FillBuffer(NumericTraits<typename ComplexTimeVaryingImageType::PixelType>::ZeroValue());
+  }
+}
+
+template<typename TFixedImage, typename TMovingImage>
+std::vector<typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::VelocityBandBlockType>
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+GetVelocityBandBlocks(const typename TimeVaryingImageType::RegionType & frequencyRegion) const
+{
+  /* Band is centered on the zero frequency and negative frequencies wrap to the end of the spectrum,
+     so in each spatial dimension it's made of the frequencies [0, r] and [N - r, N - 1].
+     Each combination of these ranges is a block which is contiguous in both the band and the spectrum. */
+  std::vector<VelocityBandBlockType> blocks;
+  for(unsigned int combination = 0; combination < (1u << ImageDimension); combination++)
+  {
+    typename TimeVaryingImageType::RegionType bandBlock = m_VelocityBandRegion;
+    typename TimeVaryingImageType::RegionType frequencyBlock = frequencyRegion;
+    bool isEmpty = false;
+    for(unsigned int i = 0; i < ImageDimension; i++)
+    {
+      const SizeValueType radius = (m_VelocityBandRegion.GetSize()[i] - 1) / 2;
+      const bool isNegative = (combination >> i) & 1;
+      if(isNegative && radius == 0){ isEmpty = true; break; }
+
+      bandBlock.SetIndex(i, m_VelocityBandRegion.GetIndex()[i] + (isNegative ? 0 : radius));
+      bandBlock.SetSize(i, isNegative ? radius : radius + 1);
+      frequencyBlock.SetIndex(i, frequencyRegion.GetIndex()[i] + (isNegative ? frequencyRegion.GetSize()[i] - radius : 0));
+      frequencyBlock.SetSize(i, bandBlock.GetSize()[i]);
+    }
+    if(!isEmpty){ blocks.push_back(VelocityBandBlockType(bandBlock, frequencyBlock)); }
+  }
+
+  return blocks;
+}
+
+template<typename TFixedImage, typename TMovingImage>
+typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::ComplexTimeVaryingImagePointer
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+ProjectOntoVelocityBand(TimeVaryingImagePointer image)
+{
+  // Calculate the Fourier transform of image...
+  using FFTType = ForwardFFTImageFilter<TimeVaryingImageType>;
+  typename FFTType::Pointer fft = FFTType::New();
+  fft->SetInput(image);
+  fft->Update();
+  ComplexTimeVaryingImagePointer spectrum = fft->GetOutput();
+
+  // ...and keep only the frequencies within the band
+  ComplexTimeVaryingImagePointer band = ComplexTimeVaryingImageType::New();
+  band->SetRegions(m_VelocityBandRegion);
+  band->Allocate();
+
+  for(const VelocityBandBlockType & block : GetVelocityBandBlocks(spectrum->GetLargestPossibleRegion()))
+  {
+    ImageRegionConstIterator<ComplexTimeVaryingImageType> spectrumIt(spectrum, block.second);
+    ImageRegionIterator<ComplexTimeVaryingImageType>      bandIt(band, block.first);
+    for(spectrumIt.GoToBegin(), bandIt.GoToBegin(); !bandIt.IsAtEnd(); ++spectrumIt, ++bandIt)
+    {
+      bandIt.Set(spectrumIt.Get());
+    }
+  }
+
+  return band;
+}
+
+template<typename TFixedImage, typename TMovingImage>
+typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::VelocityBandType
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+ProjectOntoVelocityBand(TimeVaryingFieldPointer field)
+{
+  // Project each component of field
+  VelocityBandType band;
+  for(unsigned int i = 0; i < ImageDimension; i++)
+  {
+    using ComponentExtractorType = VectorIndexSelectionCastImageFilter<TimeVaryingFieldType,TimeVaryingImageType>;
+    typename ComponentExtractorType::Pointer      componentExtractor = ComponentExtractorType::New();
+    componentExtractor->SetInput(field);
+    componentExtractor->SetIndex(i);
+    componentExtractor->Update();
+
+    band[i] = ProjectOntoVelocityBand(componentExtractor->GetOutput());
+  }
+
+  return band;
+}
+
+template<typename TFixedImage, typename TMovingImage>
+typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::TimeVaryingImagePointer
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+SynthesizeFromVelocityBand(ComplexTimeVaryingImagePointer band)
+{
+  // Zero pad band to the full spectrum of the velocity grid...
+  TimeVaryingFieldPointer velocity = this->m_OutputTransform->GetVelocityField();
+  ComplexTimeVaryingImagePointer spectrum = ComplexTimeVaryingImageType::New();
+  spectrum->CopyInformation(velocity);
+  spectrum->SetRegions(velocity->GetLargestPossibleRegion());
+  spectrum->Allocate();
+  spectrum->FillBuffer(NumericTraits<typename ComplexTimeVaryingImageType::PixelType>::ZeroValue());
+
+  for(const VelocityBandBlockType & block : GetVelocityBandBlocks(spectrum->GetLargestPossibleRegion()))
+  {
+    ImageRegionConstIterator<ComplexTimeVaryingImageType> bandIt(band, block.first);
+    ImageRegionIterator<ComplexTimeVaryingImageType>      spectrumIt(spectrum, block.second);
+    for(bandIt.GoToBegin(), spectrumIt.GoToBegin(); !bandIt.IsAtEnd(); ++bandIt, ++spectrumIt)
+    {
+      spectrumIt.Set(bandIt.Get());
+    }
+  }
+
+  // ...and take the inverse Fourier transform.
+  using IFFTType = InverseFFTImageFilter<ComplexTimeVaryingImageType,TimeVaryingImageType>;
+  typename IFFTType::Pointer ifft = IFFTType::New();
+  ifft->SetInput(spectrum);
+  ifft->Update();
+
+  return ifft->GetOutput();
+}
+
+template<typename TFixedImage, typename TMovingImage>
+typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::TimeVaryingFieldPointer
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+SynthesizeFromVelocityBand(const VelocityBandType & band)
+{
+  // Synthesize each component of field
+  using ComponentComposerType = ComposeImageFilter<TimeVaryingImageType,TimeVaryingFieldType>;
+  typename ComponentComposerType::Pointer   componentComposer = ComponentComposerType::New();
+
+  for(unsigned int i = 0; i < ImageDimension; i++)
+  {
+    componentComposer->SetInput(i,SynthesizeFromVelocityBand(band[i]));
+  }
+  componentComposer->Update();
+
+  return componentComposer->GetOutput();
+}
+
+template<typename TFixedImage, typename TMovingImage>
+typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::VelocityBandType
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+CombineVelocityBands(const VelocityBandType & band0, const VelocityBandType & band1, double scale, TimeVaryingImagePointer kernel)
+{
+  using ComplexType = typename ComplexTimeVaryingImageType::PixelType;
+  using ComplexValueType = typename ComplexType::value_type;
+  const typename TimeVaryingImageType::RegionType frequencyRegion = this->m_OutputTransform->GetVelocityField()->GetLargestPossibleRegion();
+
+  // Without a kernel the whole band is a single block
+  std::vector<VelocityBandBlockType> blocks(1, VelocityBandBlockType(m_VelocityBandRegion, m_VelocityBandRegion));
+  if(kernel){ blocks = GetVelocityBandBlocks(frequencyRegion); }
+
+  // Compute band0 + scale K band1, where K is evaluated at each frequency of the band
+  VelocityBandType band;
+  for(unsigned int i = 0; i < ImageDimension; i++)
+  {
+    band[i] = ComplexTimeVaryingImageType::New();
+    band[i]->SetRegions(m_VelocityBandRegion);
+    band[i]->Allocate();
+
+    for(const VelocityBandBlockType & block : blocks)
+    {
+      ImageRegionConstIterator<ComplexTimeVaryingImageType> it0(band0[i], block.first);
+      ImageRegionConstIterator<ComplexTimeVaryingImageType> it1(band1[i], block.first);
+      ImageRegionIterator<ComplexTimeVaryingImageType>      it(band[i], block.first);
+      ImageRegionConstIterator<TimeVaryingImageType>        kernelIt;
+      if(kernel){ kernelIt = ImageRegionConstIterator<TimeVaryingImageType>(kernel, block.second); }
+      for(it0.GoToBegin(), it1.GoToBegin(), it.GoToBegin(); !it.IsAtEnd(); ++it0, ++it1, ++it)
+      {
+        double weight = scale;
+        if(kernel){ weight *= kernelIt.Get(); ++kernelIt; }
+        it.Set(it0.Get() + static_cast<ComplexValueType>(weight) * it1.Get());
+      }
+    }
+  }
+
+  return band;
+}
+
+
+template<typename TFixedImage, typename TMovingImage>
+unsigned int
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+GetFFTSizeGreatestPrimeFactor() const
+{
+  // Sizes with prime factors up to 5 are supported by every backend
+  using FFTType = ForwardFFTImageFilter<TimeVaryingImageType>;
+  const unsigned int greatestPrimeFactor = FFTType::New()->GetSizeGreatestPrimeFactor();
+  return std::min(5u, greatestPrimeFactor);
+}
+
+template<typename TFixedImage, typename TMovingImage>
+typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::TimeVaryingImageType::SizeType
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+AutotuneFFTSize(const typename TimeVaryingImageType::SizeType & size)
+{
+  using FFTType = ForwardFFTImageFilter<TimeVaryingImageType>;
+  typename FFTType::Pointer fft = FFTType::New();
+  const unsigned int greatestPrimeFactor = GetFFTSizeGreatestPrimeFactor();
+
+  // Tuned sizes depend on backend, padding budget and grid shape
+  std::ostringstream keyStream;
+  keyStream << fft->GetNameOfClass() << " " << m_MaximumPaddingFraction;
+  for(unsigned int i = 0; i <= ImageDimension; i++){ keyStream << " " << size[i]; }
+  const std::string key = keyStream.str();
+
+  typename TimeVaryingImageType::SizeType paddedSize;
+
+  // Reuse sizes tuned by a previous run, keeping the other entries to write them back
+  std::vector<std::string> cacheLines;
+  if(!m_FFTSizeCacheFileName.empty())
+  {
+    std::ifstream cacheFile(m_FFTSizeCacheFileName.c_str());
+    std::string line;
+    while(std::getline(cacheFile, line))
+    {
+      // Skip entries which can't be parsed
+      const std::string::size_type separator = line.find(" : ");
+      if(separator == std::string::npos){ continue; }
+
+      std::istringstream sizeStream(line.substr(separator + 3));
+      typename TimeVaryingImageType::SizeType cachedSize;
+      bool isValid = true;
+      for(unsigned int i = 0; i <= ImageDimension && isValid; i++){ isValid = static_cast<bool>(sizeStream >> cachedSize[i]); }
+      isValid = isValid && (sizeStream >> std::ws).eof();
+      if(!isValid){ continue; }
+
+      if(line.substr(0, separator) != key)
+      {
+        cacheLines.push_back(line);
+        continue;
+      }
+
+      // Sizes for this grid must fit it and be admissible, otherwise they're tuned again
+      for(unsigned int i = 0; i <= ImageDimension; i++)
+      {
+        if(cachedSize[i] < size[i] || (cachedSize[i] != 1 && Math::GreatestPrimeFactor(cachedSize[i]) > greatestPrimeFactor)){ isValid = false; }
+      }
+      if(isValid){ return cachedSize; }
+    }
+  }
+
+  for(unsigned int i = 0; i <= ImageDimension; i++)
+  {
+    // Admissible sizes within budget, or the smallest admissible size if none fit
+    const SizeValueType maximumSize = size[i] + static_cast<SizeValueType>(m_MaximumPaddingFraction * size[i]);
+    std::vector<SizeValueType> candidates;
+    for(SizeValueType n = size[i]; n <= maximumSize || candidates.empty(); n++)
+    {
+      if(n == 1 || Math::GreatestPrimeFactor(n) <= greatestPrimeFactor){ candidates.push_back(n); }
+    }
+
+    // Time dimension is padded as little as possible since it also scales the cost of every other transform
+    paddedSize[i] = candidates[0];
+    if(candidates.size() == 1 || i == ImageDimension){ continue; }
+
+    // Time transforms along dimension i of a slab with the active backend
+    double fastestTime = NumericTraits<double>::max();
+    for(unsigned int c = 0; c < candidates.size(); c++)
+    {
+      typename TimeVaryingImageType::SizeType benchmarkSize;
+      benchmarkSize.Fill(1);
+      benchmarkSize[i] = candidates[c];
+      benchmarkSize[(i + 1) % (ImageDimension + 1)] = 32;
+
+      TimeVaryingImagePointer benchmarkImage = TimeVaryingImageType::New();
+      benchmarkImage->SetRegions(benchmarkSize);
+      benchmarkImage->Allocate();
+      benchmarkImage->FillBuffer(NumericTraits<VirtualPixelType>::OneValue());
+
+      // Repeat until the total is well above clock resolution and scheduling noise
+      const double minimumTotalTime = 0.01;
+      const unsigned int minimumNumberOfRepetitions = 5;
+      double totalTime = 0;
+      unsigned int numberOfRepetitions = 0;
+      while(numberOfRepetitions < minimumNumberOfRepetitions || totalTime < minimumTotalTime)
+      {
+        typename FFTType::Pointer benchmarkFFT = FFTType::New();
+        benchmarkFFT->SetInput(benchmarkImage);
+        const double startTime = m_Clock->GetTimeInSeconds();
+        benchmarkFFT->Update();
+        totalTime += m_Clock->GetTimeInSeconds() - startTime;
+        numberOfRepetitions++;
+      }
+      const double time = totalTime / numberOfRepetitions; // Mean time of one transform
+
+      // Prefer smaller sizes unless a larger one is clearly faster
+      if(time < 0.95 * fastestTime)
+      {
+        fastestTime = time;
+        paddedSize[i] = candidates[c];
+      }
+    }
+  }
+
+  if(!m_FFTSizeCacheFileName.empty())
+  {
+    std::ostringstream entryStream;
+    entryStream << key << " :";
+    for(unsigned int i = 0; i <= ImageDimension; i++){ entryStream << " " << paddedSize[i]; }
+    cacheLines.push_back(entryStream.str());
+
+    // Write a temporary file and rename it over the cache, so that concurrent runs never read a partial file.
+    // If runs tune at the same time the last rename wins and the other entry is tuned again later.
+    std::ostringstream temporaryFileNameStream;
+    temporaryFileNameStream << m_FFTSizeCacheFileName << "." << this << "." << std::fixed << std::setprecision(6) << m_Clock->GetTimeInSeconds() << ".tmp";
+    const std::string temporaryFileName = temporaryFileNameStream.str();
+
+    std::ofstream temporaryFile(temporaryFileName.c_str());
+    for(const std::string & cacheLine : cacheLines){ temporaryFile << cacheLine << "\n"; }
+    temporaryFile.close();
+
+    bool isWritten = static_cast<bool>(temporaryFile);
+    if(isWritten && std::rename(temporaryFileName.c_str(), m_FFTSizeCacheFileName.c_str()) != 0)
+    {
+      // Renaming over an existing file fails on some platforms
+      std::remove(m_FFTSizeCacheFileName.c_str());
+      isWritten = std::rename(temporaryFileName.c_str(), m_FFTSizeCacheFileName.c_str()) == 0;
+    }
+    if(!isWritten)
+    {
+      std::remove(temporaryFileName.c_str());
+      itkWarningMacro("Couldn't write FFT size cache file " << m_FFTSizeCacheFileName << ".");
+    }
+  }
+
+  return paddedSize;
+}
+
 template<typename TFixedImage, typename TMovingImage>
 void
 MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
 Initialize()
 {
+  // Shooting generates the velocity from momentum so it can't also be band-limited
+  if(m_UseGeodesicShooting && m_UseBandLimitedVelocity)
+  {
+    itkExceptionMacro("UseGeodesicShooting and UseBandLimitedVelocity can't both be enabled.");
+  }
+
+  // Shooting doesn't generate the rate so bias correction is turned off
+  if(m_UseGeodesicShooting && m_UseBias && m_Mu >= NumericTraits<double>::epsilon())
+  {
+    itkWarningMacro("UseBias is turned off because UseGeodesicShooting is enabled.");
+    m_UseBias = false;
+  }
+
   // Initialize velocity, v = 0 by seting velocity information based on fixed image and number of time steps
   typename FixedImageType::ConstPointer fixedImage = this->GetFixedImage();
   typename FixedImageType::RegionType fixedRegion = fixedImage->GetLargestPossibleRegion();
@@ -199,20 +619,27 @@ Initialize()
   FFT runs most efficiently when each diminsion's size has a small prime factorization.
   Therefore we pad the velocity so that this condition is met.
   */
-  using FFTType = ForwardFFTImageFilter<TimeVaryingImageType>;
-  unsigned int greatestPrimeFactor = FFTType::New()->GetSizeGreatestPrimeFactor();
-
-  using PadderType = FFTPadImageFilter<TimeVaryingFieldType>;
-  typename PadderType::Pointer padder = PadderType::New();
-  padder->SetSizeGreatestPrimeFactor(std::min((unsigned int)5, greatestPrimeFactor));
-  padder->SetInput(velocity);
-  padder->Update();
-  velocity = padder->GetOutput();
-
-  // Use size but not index from padder
-  velocitySize = velocity->GetLargestPossibleRegion().GetSize();
-  velocityRegion.SetSize(velocitySize);
-  velocity->SetRegions(velocityRegion);
+  if(m_UseFFTSizeAutotuning)
+  {
+    velocitySize = AutotuneFFTSize(velocitySize);
+    velocityRegion.SetSize(velocitySize);
+    velocity->SetRegions(velocityRegion);
+    velocity->Allocate();
+  }
+  else
+  {
+    using PadderType = FFTPadImageFilter<TimeVaryingFieldType>;
+    typename PadderType::Pointer padder = PadderType::New();
+    padder->SetSizeGreatestPrimeFactor(GetFFTSizeGreatestPrimeFactor());
+    padder->SetInput(velocity);
+    padder->Update();
+    velocity = padder->GetOutput();
+
+    // Use size but not index from padder
+    velocitySize = velocity->GetLargestPossibleRegion().GetSize();
+    velocityRegion.SetSize(velocitySize);
+    velocity->SetRegions(velocityRegion);
+  }
   velocity->FillBuffer(NumericTraits<VectorType>::ZeroValue());
 
   // Initialize displacement, /phi_{10}
@@ -222,6 +649,9 @@ Initialize()
   this->m_OutputTransform->SetUpperTimeBound(0.0);
   this->m_OutputTransform->IntegrateVelocityField();
 
+  // Initialize band-limited velocity, \hat{v} = 0
+  if(m_UseBandLimitedVelocity){ InitializeVelocityBand(); }
+
   // Initialize virtual image using velocity
   typename VirtualImageType::IndexType virtualIndex;
   typename VirtualImageType::SizeType virtualSize;
@@ -331,6 +761,20 @@ Initialize()
   m_TimeStep = 1.0/(m_NumberOfTimeSteps - 1); // \Delta t
   m_RecalculateEnergy = true; // v and r have been initialized
 
+  // Initialize initial momentum, p_0 = 0, and shoot v = 0 and I(t) = I_0 from it
+  if(m_UseGeodesicShooting)
+  {
+    m_SpatialVelocityKernel = ExtractSlice(m_VelocityKernel, 0); // Kernels don't vary in time so any slice will do
+
+    m_InitialMomentum = VirtualImageType::New();
+    m_InitialMomentum->CopyInformation(m_VirtualImage);
+    m_InitialMomentum->SetRegions(virtualRegion);
+    m_InitialMomentum->Allocate();
+    m_InitialMomentum->FillBuffer(NumericTraits<VirtualPixelType>::ZeroValue());
+
+    Shoot();
+  }
+
   using FixedCasterType = CastImageFilter<FixedImageType, VirtualImageType>;
   typename FixedCasterType::Pointer fixedCaster = FixedCasterType::New();
   fixedCaster->SetInput(this->GetFixedImage());
@@ -346,63 +790,105 @@ Initialize()
 }
 
 template<typename TFixedImage, typename TMovingImage>
-double
+template<typename TImage>
+std::vector<double>
 MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
-CalculateNorm(TimeVaryingImagePointer image)
+CalculateSliceSumsOfSquares(const TImage * image)
 {
-  using CalculatorType = StatisticsImageFilter<TimeVaryingImageType>;
-  typename CalculatorType::Pointer calculator = CalculatorType::New();
-  calculator->SetInput(image);
-  calculator->Update();
+  /* Compute \sum_x |x(t_j)|^2 for every time slice j in one threaded pass over the buffer.
+     Slices are contiguous since time is the last dimension. */
+  const SizeValueType numberOfSlices = image->GetBufferedRegion().GetSize()[ImageDimension];
+  const SizeValueType sliceSize = image->GetBufferedRegion().GetNumberOfPixels() / numberOfSlices;
+  const SizeValueType chunkSize = 16384;
+  const SizeValueType numberOfChunksPerSlice = (sliceSize + chunkSize - 1) / chunkSize;
+  const typename TImage::PixelType * buffer = image->GetBufferPointer();
+
+  // Each chunk writes its own partial sum so that the result does not depend on thread scheduling
+  std::vector<double> chunkSums(numberOfSlices * numberOfChunksPerSlice, 0);
+
+  MultiThreaderBase::Pointer threader = MultiThreaderBase::New();
+  threader->ParallelizeArray(0, chunkSums.size(),
+    [&](SizeValueType chunk)
+    {
+      const SizeValueType slice = chunk / numberOfChunksPerSlice;
+      const SizeValueType first = slice * sliceSize + (chunk % numberOfChunksPerSlice) * chunkSize;
+      const SizeValueType last = std::min(first + chunkSize, (slice + 1) * sliceSize);
 
-  // sumOfSquares = (var(x) + mean(x)^2)*length(x)
-  double sumOfSquares = (calculator->GetVariance()+std::pow(calculator->GetMean(),2))*image->GetLargestPossibleRegion().GetNumberOfPixels();
-  return std::sqrt(sumOfSquares*m_VoxelVolume*m_TimeStep);
+      CompensatedSummation<double> sum;
+      for(SizeValueType k = first; k < last; k++){ sum += SquaredNorm(buffer[k]); } // |x|^2
+      chunkSums[chunk] = sum.GetSum();
+    }, nullptr);
+
+  std::vector<double> sliceSums(numberOfSlices, 0);
+  for(SizeValueType j = 0; j < numberOfSlices; j++)
+  {
+    CompensatedSummation<double> sum;
+    for(SizeValueType c = 0; c < numberOfChunksPerSlice; c++){ sum += chunkSums[j * numberOfChunksPerSlice + c]; }
+    sliceSums[j] = sum.GetSum();
+  }
+
+  return sliceSums;
 }
 
 template<typename TFixedImage, typename TMovingImage>
+template<typename TImage>
 double
 MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
-CalculateNorm(TimeVaryingFieldPointer field)
+CalculateNorm(const SmartPointer<TImage> & image)
 {
-  using MagnitudeFilterType = VectorMagnitudeImageFilter<TimeVaryingFieldType,TimeVaryingImageType>;
-  typename MagnitudeFilterType::Pointer magnitudeFilter = MagnitudeFilterType::New();
-  magnitudeFilter->SetInput(field);
-  magnitudeFilter->Update();
+  const std::vector<double> sliceSums = CalculateSliceSumsOfSquares(image.GetPointer());
 
-  return CalculateNorm(magnitudeFilter->GetOutput());
+  CompensatedSummation<double> sumOfSquares;
+  for(unsigned int j = 0; j < sliceSums.size(); j++){ sumOfSquares += sliceSums[j]; }
+  return std::sqrt(sumOfSquares.GetSum()*m_VoxelVolume*m_TimeStep);
 }
 
-
 template<typename TFixedImage, typename TMovingImage>
 double
 MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
-GetLength()
+CalculateNorm(const VelocityBandType & band, TimeVaryingImagePointer kernel)
 {
-  typename TimeVaryingFieldType::Pointer velocity = this->m_OutputTransform->GetVelocityField();
+  const typename TimeVaryingImageType::RegionType frequencyRegion = this->m_OutputTransform->GetVelocityField()->GetLargestPossibleRegion();
 
-  typename TimeVaryingImageType::IndexType  index;
-  index.Fill(0);
+  // Without a kernel the whole band is a single block
+  std::vector<VelocityBandBlockType> blocks(1, VelocityBandBlockType(m_VelocityBandRegion, m_VelocityBandRegion));
+  if(kernel){ blocks = GetVelocityBandBlocks(frequencyRegion); }
 
-  typename TimeVaryingImageType::SizeType   size = velocity->GetLargestPossibleRegion().GetSize();
-  size[ImageDimension] = 1;
+  double sumOfSquares = 0;
+  for(unsigned int i = 0; i < ImageDimension; i++)
+  {
+    for(const VelocityBandBlockType & block : blocks)
+    {
+      ImageRegionConstIterator<ComplexTimeVaryingImageType> it(band[i], block.first);
+      ImageRegionConstIterator<TimeVaryingImageType>        kernelIt;
+      if(kernel){ kernelIt = ImageRegionConstIterator<TimeVaryingImageType>(kernel, block.second); }
+      for(it.GoToBegin(); !it.IsAtEnd(); ++it)
+      {
+        double weight = 1;
+        if(kernel){ weight = kernelIt.Get(); ++kernelIt; }
+        sumOfSquares += std::norm(it.Get()) * weight * weight;
+      }
+    }
+  }
 
-  typename TimeVaryingImageType::RegionType region(index,size);
+  // Parseval's theorem, \sum |x|^2 = N^{-1} \sum |X|^2
+  sumOfSquares /= frequencyRegion.GetNumberOfPixels();
+  return std::sqrt(sumOfSquares*m_VoxelVolume*m_TimeStep);
+}
+
+
+template<typename TFixedImage, typename TMovingImage>
+double
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+GetLength()
+{
+  // Per-slice norms come from the same pass over v
+  const std::vector<double> sliceSums = CalculateSliceSumsOfSquares(this->m_OutputTransform->GetVelocityField());
 
   double length = 0;
   for(unsigned int j = 0; j < m_NumberOfTimeSteps; j++)
   {
-    index[ImageDimension] = j;
-    region.SetIndex(index);
-
-    using ExtractorType = ExtractImageFilter<TimeVaryingFieldType, TimeVaryingFieldType>;
-    typename ExtractorType::Pointer extractor = ExtractorType::New();
-    extractor->SetInput(velocity);                    // v
-    extractor->SetExtractionRegion(region);
-    extractor->SetDirectionCollapseToIdentity();
-    extractor->Update();
-
-    length += CalculateNorm(extractor->GetOutput()); // || v_j || \Delta t
+    length += std::sqrt(sliceSums[j]*m_VoxelVolume*m_TimeStep); // || v_j || \Delta t
   }
 
   return length;  // \sum_{j=0}^{J-1} || v_j || \Delta t
@@ -414,6 +900,10 @@ double
 MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
 GetVelocityEnergy()
 {
+  if(m_UseBandLimitedVelocity)
+  {
+    return 0.5 * std::pow(CalculateNorm(m_VelocityBand,m_InverseVelocityKernel),2); // 0.5 ||L_V \hat{v}||^2
+  }
   return 0.5 * std::pow(CalculateNorm(ApplyKernel(m_InverseVelocityKernel,this->m_OutputTransform->GetVelocityField())),2); // 0.5 ||L_V V||^2
 }
 
@@ -473,7 +963,8 @@ double
 MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
 GetImageEnergyFraction()
 {
-  double imageEnergyFraction = (GetImageEnergy() - m_MinImageEnergy) / (m_MaxImageEnergy - m_MinImageEnergy);
+  GetEnergy(); // Memoizes E_image for current state
+  double imageEnergyFraction = (m_ImageEnergy - m_MinImageEnergy) / (m_MaxImageEnergy - m_MinImageEnergy);
   if(std::isnan(imageEnergyFraction)){ return 0; }
   return imageEnergyFraction;
 }
@@ -486,12 +977,76 @@ GetEnergy()
 {
   if(m_RecalculateEnergy == true)
   {
-    m_Energy = GetVelocityEnergy() + GetRateEnergy() + GetImageEnergy(); // E = E_velocity + E_rate + E_image
+    // Memoize components so they are not recomputed for the same state
+    m_VelocityEnergy = GetVelocityEnergy();
+    m_RateEnergy = GetRateEnergy();
+    m_ImageEnergy = GetImageEnergy();
+    m_Energy = m_VelocityEnergy + m_RateEnergy + m_ImageEnergy; // E = E_velocity + E_rate + E_image
     m_RecalculateEnergy = false;
   }
   return m_Energy;
 }
 
+template<typename TFixedImage, typename TMovingImage>
+void
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+SaveState()
+{
+  GetEnergy();
+
+  // Shooting generates v and I(t) from p_0 and a band-limited v is synthesized from its band,
+  // so only p_0 or the band is kept
+  const bool keepVelocity = !m_UseGeodesicShooting && !m_UseBandLimitedVelocity;
+  m_AcceptedState.velocity = keepVelocity ? this->m_OutputTransform->GetVelocityField() : nullptr;
+  m_AcceptedState.rate = m_Rate;
+  m_AcceptedState.velocityBand = m_VelocityBand;
+  m_AcceptedState.initialMomentum = m_InitialMomentum;
+  m_AcceptedState.displacementField = this->m_OutputTransform->GetModifiableDisplacementField();
+  m_AcceptedState.inverseDisplacementField = this->m_OutputTransform->GetModifiableInverseDisplacementField();
+  m_AcceptedState.bias = m_Bias;
+  m_AcceptedState.forwardImage = m_ForwardImage;
+  m_AcceptedState.forwardMaskImage = m_ForwardMaskImage;
+  m_AcceptedState.velocityEnergy = m_VelocityEnergy;
+  m_AcceptedState.rateEnergy = m_RateEnergy;
+  m_AcceptedState.imageEnergy = m_ImageEnergy;
+  m_AcceptedState.energy = m_Energy;
+}
+
+template<typename TFixedImage, typename TMovingImage>
+void
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+RestoreState()
+{
+  // Fields are never modified in place after being replaced, so restoring only swaps pointers
+  // and the saved energies remain valid. With shooting, v and I(t) are generated from p_0 again,
+  // and a band-limited v is synthesized from its band again.
+  m_InitialMomentum = m_AcceptedState.initialMomentum;
+  m_VelocityBand = m_AcceptedState.velocityBand;
+  if(m_UseGeodesicShooting)
+  {
+    Shoot();
+  }
+  else if(m_UseBandLimitedVelocity)
+  {
+    this->m_OutputTransform->SetVelocityField(SynthesizeFromVelocityBand(m_VelocityBand));
+  }
+  else
+  {
+    this->m_OutputTransform->SetVelocityField(m_AcceptedState.velocity);
+  }
+  this->m_OutputTransform->SetDisplacementField(m_AcceptedState.displacementField);
+  this->m_OutputTransform->SetInverseDisplacementField(m_AcceptedState.inverseDisplacementField);
+  m_Rate = m_AcceptedState.rate;
+  m_Bias = m_AcceptedState.bias;
+  m_ForwardImage = m_AcceptedState.forwardImage;
+  m_ForwardMaskImage = m_AcceptedState.forwardMaskImage;
+  m_VelocityEnergy = m_AcceptedState.velocityEnergy;
+  m_RateEnergy = m_AcceptedState.rateEnergy;
+  m_ImageEnergy = m_AcceptedState.imageEnergy;
+  m_Energy = m_AcceptedState.energy;
+  m_RecalculateEnergy = false;
+}
+
 template<typename TFixedImage, typename TMovingImage>
 void
 MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
@@ -505,8 +1060,18 @@ IntegrateRate()
 
   typename TimeVaryingImageType::RegionType region(index,size);
 
+  // Start from a new image so that a saved bias is not overwritten
+  m_Bias = BiasImageType::New();
+  m_Bias->CopyInformation(m_VirtualImage);
+  m_Bias->SetRegions(m_VirtualImage->GetLargestPossibleRegion());
+  m_Bias->Allocate();
   m_Bias->FillBuffer(NumericTraits<VirtualPixelType>::Zero); // B(0) = 0;
 
+  // Integrate with a separate transform so that \phi_{10} and log|D\phi_{10}| of the output transform are kept
+  typename OutputTransformType::Pointer rateTransform = OutputTransformType::New();
+  rateTransform->UseInverseOff();
+  rateTransform->SetVelocityField(this->m_OutputTransform->GetVelocityField()); // v
+
   for(unsigned int j = 1; j < m_NumberOfTimeSteps; j++)
   {
     index[ImageDimension] = j-1;
@@ -528,16 +1093,16 @@ IntegrateRate()
     adder->SetInput1(multiplier->GetOutput());      // r(j-1) \Delta t
     adder->SetInput2(m_Bias);                       // B(j-1)
 
-    this->m_OutputTransform->SetNumberOfIntegrationSteps(2);
-    this->m_OutputTransform->SetLowerTimeBound(j * m_TimeStep);     // t_j
-    this->m_OutputTransform->SetUpperTimeBound((j-1) * m_TimeStep); // t_{j-1}
-    this->m_OutputTransform->IntegrateVelocityField();
+    rateTransform->SetNumberOfIntegrationSteps(2);
+    rateTransform->SetLowerTimeBound(j * m_TimeStep);     // t_j
+    rateTransform->SetUpperTimeBound((j-1) * m_TimeStep); // t_{j-1}
+    rateTransform->IntegrateVelocityField();
 
     using ExtrapolatorType = WrapExtrapolateImageFunction<VirtualImageType, RealType>;
     using ResamplerType = ResampleImageFilter<VirtualImageType,VirtualImageType,RealType>;
     typename ResamplerType::Pointer  resampler = ResamplerType::New();
     resampler->SetInput(adder->GetOutput());                    // r(j-1) \Delta t + B(j-1)
-    resampler->SetTransform(this->m_OutputTransform);           // \phi_{j,j-1}
+    resampler->SetTransform(rateTransform);                     // \phi_{j,j-1}
     resampler->UseReferenceImageOn();
     resampler->SetReferenceImage(m_VirtualImage);
     resampler->SetExtrapolator(ExtrapolatorType::New());
@@ -547,6 +1112,256 @@ IntegrateRate()
   }
 }
 
+template<typename TFixedImage, typename TMovingImage>
+template<typename TTimeVaryingImage, typename TImage>
+typename TImage::Pointer
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+ExtractSliceFromImage(TTimeVaryingImage * image, unsigned int j)
+{
+  typename TTimeVaryingImage::RegionType region = image->GetLargestPossibleRegion();
+  typename TTimeVaryingImage::IndexType  index = region.GetIndex();
+  typename TTimeVaryingImage::SizeType   size = region.GetSize();
+  index[ImageDimension] += j;
+  size[ImageDimension] = 0;
+  region.SetIndex(index);
+  region.SetSize(size);
+
+  using ExtractorType = ExtractImageFilter<TTimeVaryingImage,TImage>;
+  typename ExtractorType::Pointer extractor = ExtractorType::New();
+  extractor->SetInput(image);
+  extractor->SetExtractionRegion(region);
+  extractor->SetDirectionCollapseToIdentity();
+  extractor->Update();
+
+  // Use virtual image's geometry so that slice can be applied to images on its grid
+  typename TImage::Pointer slice = extractor->GetOutput();
+  slice->DisconnectPipeline();
+  slice->CopyInformation(m_VirtualImage);
+
+  return slice;
+}
+
+template<typename TFixedImage, typename TMovingImage>
+typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::VirtualImagePointer
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+ExtractSlice(TimeVaryingImagePointer image, unsigned int j)
+{
+  return ExtractSliceFromImage<TimeVaryingImageType,VirtualImageType>(image, j);
+}
+
+template<typename TFixedImage, typename TMovingImage>
+typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::FieldPointer
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+ExtractSlice(TimeVaryingFieldPointer field, unsigned int j)
+{
+  return ExtractSliceFromImage<TimeVaryingFieldType,FieldType>(field, j);
+}
+
+template<typename TFixedImage, typename TMovingImage>
+typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::FieldPointer
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+IntegrateTimeStep(FieldPointer velocity, double timeStep, LogJacobianDeterminantImagePointer * logJacobianDeterminant)
+{
+  // Scale velocity by time step, \Delta t v...
+  using FieldMultiplierType = MultiplyImageFilter<FieldType,VirtualImageType>;
+  typename FieldMultiplierType::Pointer multiplier = FieldMultiplierType::New();
+  multiplier->SetInput(velocity);     // v
+  multiplier->SetConstant(timeStep);  // \Delta t
+
+  // ...hold it constant over a unit time interval...
+  using FieldJoinerType = JoinSeriesImageFilter<FieldType,TimeVaryingFieldType>;
+  typename FieldJoinerType::Pointer joiner = FieldJoinerType::New();
+  joiner->PushBackInput(multiplier->GetOutput());
+  joiner->PushBackInput(multiplier->GetOutput());
+  joiner->Update();
+
+  // ...and integrate it, x + \Delta t v(x), transporting log|D(x + \Delta t v(x))| if requested
+  typename OutputTransformType::Pointer transform = OutputTransformType::New();
+  transform->UseInverseOff();
+  transform->SetCalculateLogJacobianDeterminant(logJacobianDeterminant != nullptr);
+  transform->SetVelocityField(joiner->GetOutput());
+  transform->SetNumberOfIntegrationSteps(2);
+  transform->SetLowerTimeBound(0.0);
+  transform->SetUpperTimeBound(1.0);
+  transform->IntegrateVelocityField();
+
+  if(logJacobianDeterminant){ *logJacobianDeterminant = transform->GetLogJacobianDeterminant(); }
+  return transform->GetModifiableDisplacementField();
+}
+
+template<typename TFixedImage, typename TMovingImage>
+void
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+Shoot()
+{
+  /* Generate velocity, v(t) = -K_V[p(t) \nabla I(t)], from initial momentum, p_0,
+     where I(t) = I_0 o \phi_{t0} and p(t) = |D\phi_{t0}| p_0 o \phi_{t0}.
+     Each map is built from the previous one with a single time step,
+     \phi_{t0} = \phi_{t-\Delta t,0} o \phi_{t,t-\Delta t} and
+     log|D\phi_{t0}| = log|D\phi_{t-\Delta t,0}| o \phi_{t,t-\Delta t} + log|D\phi_{t,t-\Delta t}| */
+  TimeVaryingFieldPointer velocityOld = this->m_OutputTransform->GetVelocityField();
+  TimeVaryingFieldPointer velocity = TimeVaryingFieldType::New();
+  velocity->CopyInformation(velocityOld);
+  velocity->SetRegions(velocityOld->GetLargestPossibleRegion());
+  velocity->Allocate();
+
+  TimeVaryingImagePointer imageTrajectory = TimeVaryingImageType::New();
+  imageTrajectory->CopyInformation(velocityOld);
+  imageTrajectory->SetRegions(velocityOld->GetLargestPossibleRegion());
+  imageTrajectory->Allocate();
+
+  const typename VirtualImageType::RegionType virtualRegion = m_VirtualImage->GetLargestPossibleRegion();
+
+  typename TimeVaryingFieldType::RegionType sliceRegion = velocity->GetLargestPossibleRegion();
+  sliceRegion.SetSize(ImageDimension, 1);
+
+  using InterpolatorType = LinearInterpolateImageFunction<MovingImageType, RealType>;
+  typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+  interpolator->SetInputImage(this->GetMovingImage()); // I_0
+
+  using ExtrapolatorType = WrapExtrapolateImageFunction<MovingImageType, RealType>;
+  typename ExtrapolatorType::Pointer extrapolator = ExtrapolatorType::New();
+  extrapolator->SetInputImage(this->GetMovingImage());
+
+  using MomentumInterpolatorType = LinearInterpolateImageFunction<VirtualImageType, RealType>;
+  typename MomentumInterpolatorType::Pointer momentumInterpolator = MomentumInterpolatorType::New();
+  momentumInterpolator->SetInputImage(m_InitialMomentum); // p_0
+
+  using MomentumExtrapolatorType = WrapExtrapolateImageFunction<VirtualImageType, RealType>;
+  typename MomentumExtrapolatorType::Pointer momentumExtrapolator = MomentumExtrapolatorType::New();
+  momentumExtrapolator->SetInputImage(m_InitialMomentum);
+
+  using DisplacementInterpolatorType = VectorLinearInterpolateImageFunction<FieldType, RealType>;
+  using DisplacementExtrapolatorType = WrapExtrapolateImageFunction<FieldType, RealType>;
+  using LogJacobianDeterminantInterpolatorType = LinearInterpolateImageFunction<LogJacobianDeterminantImageType, RealType>;
+  using LogJacobianDeterminantExtrapolatorType = WrapExtrapolateImageFunction<LogJacobianDeterminantImageType, RealType>;
+  using GradientFilterType = GradientImageFilter<VirtualImageType, RealType, RealType>;
+  using FieldMultiplierType = MultiplyImageFilter<FieldType,VirtualImageType>;
+
+  FieldPointer                       displacement;           // \phi_{t-\Delta t,0}
+  LogJacobianDeterminantImagePointer logJacobianDeterminant; // log|D\phi_{t-\Delta t,0}|
+  FieldPointer                       velocitySlice;          // v(t - \Delta t)
+
+  // For each time step
+  for(unsigned int j = 0; j < m_NumberOfTimeSteps; j++)
+  {
+    // Integrate one step back in time, \phi_{t,t-\Delta t}, with the velocity generated at t - \Delta t
+    FieldPointer                       stepDisplacement;
+    LogJacobianDeterminantImagePointer stepLogJacobianDeterminant;
+    typename DisplacementInterpolatorType::Pointer           displacementInterpolator = DisplacementInterpolatorType::New();
+    typename DisplacementExtrapolatorType::Pointer           displacementExtrapolator = DisplacementExtrapolatorType::New();
+    typename LogJacobianDeterminantInterpolatorType::Pointer logJacobianDeterminantInterpolator = LogJacobianDeterminantInterpolatorType::New();
+    typename LogJacobianDeterminantExtrapolatorType::Pointer logJacobianDeterminantExtrapolator = LogJacobianDeterminantExtrapolatorType::New();
+    if(j > 0)
+    {
+      stepDisplacement = IntegrateTimeStep(velocitySlice, -m_TimeStep, &stepLogJacobianDeterminant);
+
+      displacementInterpolator->SetInputImage(displacement);
+      displacementExtrapolator->SetInputImage(displacement);
+      logJacobianDeterminantInterpolator->SetInputImage(logJacobianDeterminant);
+      logJacobianDeterminantExtrapolator->SetInputImage(logJacobianDeterminant);
+    }
+
+    FieldPointer newDisplacement = FieldType::New();
+    newDisplacement->CopyInformation(m_VirtualImage);
+    newDisplacement->SetRegions(virtualRegion);
+    newDisplacement->Allocate();
+
+    LogJacobianDeterminantImagePointer newLogJacobianDeterminant = LogJacobianDeterminantImageType::New();
+    newLogJacobianDeterminant->CopyInformation(m_VirtualImage);
+    newLogJacobianDeterminant->SetRegions(virtualRegion);
+    newLogJacobianDeterminant->Allocate();
+
+    VirtualImagePointer image = VirtualImageType::New();
+    image->CopyInformation(m_VirtualImage);
+    image->SetRegions(virtualRegion);
+    image->Allocate();
+
+    VirtualImagePointer momentum = VirtualImageType::New();
+    momentum->CopyInformation(m_VirtualImage);
+    momentum->SetRegions(virtualRegion);
+    momentum->Allocate();
+
+    // Compose maps and compute image, I(t), and momentum, p(t), in a single pass
+    MultiThreaderBase::Pointer threader = MultiThreaderBase::New();
+    threader->ParallelizeImageRegion<ImageDimension>(virtualRegion,
+      [&](const typename VirtualImageType::RegionType & region)
+      {
+        ImageRegionIteratorWithIndex<FieldType> it(newDisplacement, region);
+        for(it.GoToBegin(); !it.IsAtEnd(); ++it)
+        {
+          typename FieldType::PointType point;
+          newDisplacement->TransformIndexToPhysicalPoint(it.GetIndex(), point); // x
+
+          VectorType u = NumericTraits<VectorType>::ZeroValue();
+          RealType   logJ = 0;
+          if(stepDisplacement)
+          {
+            const VectorType stepU = stepDisplacement->GetPixel(it.GetIndex());
+            const typename FieldType::PointType stepPoint = point + stepU; // \phi_{t,t-\Delta t}(x)
+
+            u = stepU + (displacementInterpolator->IsInsideBuffer(stepPoint) ? displacementInterpolator->Evaluate(stepPoint) : displacementExtrapolator->Evaluate(stepPoint)); // \phi_{t0}(x) - x
+            logJ = stepLogJacobianDeterminant->GetPixel(it.GetIndex()) +
+              (logJacobianDeterminantInterpolator->IsInsideBuffer(stepPoint) ? logJacobianDeterminantInterpolator->Evaluate(stepPoint) : logJacobianDeterminantExtrapolator->Evaluate(stepPoint)); // log|D\phi_{t0}(x)|
+          }
+          it.Set(u);
+          newLogJacobianDeterminant->SetPixel(it.GetIndex(), logJ);
+
+          const typename FieldType::PointType mappedPoint = point + u; // \phi_{t0}(x)
+          const RealType imageValue = interpolator->IsInsideBuffer(mappedPoint) ? interpolator->Evaluate(mappedPoint) : extrapolator->Evaluate(mappedPoint); // I_0(\phi_{t0}(x))
+          const RealType momentumValue = momentumInterpolator->IsInsideBuffer(mappedPoint) ? momentumInterpolator->Evaluate(mappedPoint) : momentumExtrapolator->Evaluate(mappedPoint); // p_0(\phi_{t0}(x))
+          image->SetPixel(it.GetIndex(), static_cast<VirtualPixelType>(imageValue));
+          momentum->SetPixel(it.GetIndex(), static_cast<VirtualPixelType>(std::exp(logJ) * momentumValue)); // |D\phi_{t0}(x)| p_0(\phi_{t0}(x))
+        }
+      }, nullptr);
+
+    displacement = newDisplacement;
+    logJacobianDeterminant = newLogJacobianDeterminant;
+
+    typename GradientFilterType::Pointer gradientFilter = GradientFilterType::New();
+    gradientFilter->SetInput(image); // I(t)
+    gradientFilter->Update();        // \nabla I(t)
+
+    // Compute force, p(t) \nabla I(t)
+    FieldPointer force = FieldType::New();
+    force->CopyInformation(m_VirtualImage);
+    force->SetRegions(virtualRegion);
+    force->Allocate();
+
+    ImageRegionConstIterator<typename GradientFilterType::OutputImageType> gradientIt(gradientFilter->GetOutput(), virtualRegion);
+    ImageRegionConstIterator<VirtualImageType>                              momentumIt(momentum, virtualRegion);
+    ImageRegionIterator<FieldType>                                          forceIt(force, virtualRegion);
+    for(gradientIt.GoToBegin(), momentumIt.GoToBegin(), forceIt.GoToBegin(); !forceIt.IsAtEnd(); ++gradientIt, ++momentumIt, ++forceIt)
+    {
+      VectorType f;
+      for(unsigned int i = 0; i < ImageDimension; i++){ f[i] = momentumIt.Get() * gradientIt.Get()[i]; }
+      forceIt.Set(f);
+    }
+
+    // Compute velocity, v(t) = -K_V[p(t) \nabla I(t)]
+    typename FieldMultiplierType::Pointer multiplier = FieldMultiplierType::New();
+    multiplier->SetInput(ApplyKernel(m_SpatialVelocityKernel, force)); // K_V[p(t) \nabla I(t)]
+    multiplier->SetConstant(-1.0);
+    multiplier->Update();
+    velocitySlice = multiplier->GetOutput(); // v(t)
+
+    // Store v(t) and I(t)
+    sliceRegion.SetIndex(ImageDimension, velocity->GetLargestPossibleRegion().GetIndex()[ImageDimension] + j);
+    ImageRegionConstIterator<FieldType>        velocitySliceIt(velocitySlice, virtualRegion);
+    ImageRegionConstIterator<VirtualImageType> imageIt(image, virtualRegion);
+    ImageRegionIterator<TimeVaryingFieldType>  velocityIt(velocity, sliceRegion);
+    ImageRegionIterator<TimeVaryingImageType>  imageTrajectoryIt(imageTrajectory, sliceRegion);
+    for(velocitySliceIt.GoToBegin(), imageIt.GoToBegin(), velocityIt.GoToBegin(), imageTrajectoryIt.GoToBegin(); !velocityIt.IsAtEnd(); ++velocitySliceIt, ++imageIt, ++velocityIt, ++imageTrajectoryIt)
+    {
+      velocityIt.Set(velocitySliceIt.Get());
+      imageTrajectoryIt.Set(imageIt.Get());
+    }
+  } // end for j
+
+  this->m_OutputTransform->SetVelocityField(velocity);
+  m_ImageTrajectory = imageTrajectory; // I(t)
+}
+
 template<typename TFixedImage, typename TMovingImage>
 typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::BiasImagePointer
 MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
@@ -562,6 +1377,114 @@ GetBias()
   return resampler->GetOutput();
 }
 
+template<typename TFixedImage, typename TMovingImage>
+void
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+WarpForward(FieldPointer field)
+{
+  /* Compute I(1) = I_0 o \phi_{10} + B(1) and M(1) = M_0 o \phi_{10} in a single pass,
+     evaluating \phi_{10} once per voxel */
+  using DisplacementFieldTransformType = DisplacementFieldTransform<RealType,ImageDimension>;
+  typename DisplacementFieldTransformType::Pointer transform = DisplacementFieldTransformType::New();
+  transform->SetDisplacementField(field); // \phi_{10}
+
+  using InterpolatorType = LinearInterpolateImageFunction<MovingImageType, RealType>;
+  typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+  interpolator->SetInputImage(this->GetMovingImage()); // I_0
+
+  using ExtrapolatorType = WrapExtrapolateImageFunction<MovingImageType, RealType>;
+  typename ExtrapolatorType::Pointer extrapolator = ExtrapolatorType::New();
+  extrapolator->SetInputImage(this->GetMovingImage());
+
+  using BiasInterpolatorType = LinearInterpolateImageFunction<BiasImageType, RealType>;
+  typename BiasInterpolatorType::Pointer biasInterpolator;
+  if(m_UseBias)
+  {
+    biasInterpolator = BiasInterpolatorType::New();
+    biasInterpolator->SetInputImage(m_Bias); // B(1)
+  }
+
+  using MaskInterpolatorType = NearestNeighborInterpolateImageFunction<MaskImageType, RealType>;
+  using MaskExtrapolatorType = WrapExtrapolateImageFunction<MaskImageType, RealType>;
+  typename MaskInterpolatorType::Pointer maskInterpolator;
+  typename MaskExtrapolatorType::Pointer maskExtrapolator;
+
+  VirtualImagePointer forwardImage = VirtualImageType::New();
+  forwardImage->CopyInformation(this->GetFixedImage());
+  forwardImage->SetRegions(this->GetFixedImage()->GetLargestPossibleRegion());
+  forwardImage->Allocate();
+
+  MaskImagePointer forwardMaskImage;
+  if(m_ForwardMaskImage)
+  {
+    maskInterpolator = MaskInterpolatorType::New();
+    maskInterpolator->SetInputImage(m_MovingMaskImage); // M_0
+
+    maskExtrapolator = MaskExtrapolatorType::New();
+    maskExtrapolator->SetInputImage(m_MovingMaskImage);
+    maskExtrapolator->SetInterpolator(maskInterpolator);
+
+    forwardMaskImage = MaskImageType::New();
+    forwardMaskImage->CopyInformation(forwardImage);
+    forwardMaskImage->SetRegions(forwardImage->GetLargestPossibleRegion());
+    forwardMaskImage->Allocate();
+  }
+
+  MultiThreaderBase::Pointer threader = MultiThreaderBase::New();
+  threader->ParallelizeImageRegion<ImageDimension>(forwardImage->GetLargestPossibleRegion(),
+    [&](const typename VirtualImageType::RegionType & region)
+    {
+      ImageRegionIteratorWithIndex<VirtualImageType> it(forwardImage, region);
+      for(it.GoToBegin(); !it.IsAtEnd(); ++it)
+      {
+        typename DisplacementFieldTransformType::InputPointType point;
+        forwardImage->TransformIndexToPhysicalPoint(it.GetIndex(), point); // x
+        const typename DisplacementFieldTransformType::OutputPointType mappedPoint = transform->TransformPoint(point); // \phi_{10}(x)
+
+        RealType value = interpolator->IsInsideBuffer(mappedPoint) ? interpolator->Evaluate(mappedPoint) : extrapolator->Evaluate(mappedPoint); // I_0(\phi_{10}(x))
+        if(biasInterpolator && biasInterpolator->IsInsideBuffer(point))
+        {
+          value += biasInterpolator->Evaluate(point); // I_0(\phi_{10}(x)) + B(1,x)
+        }
+        it.Set(static_cast<VirtualPixelType>(value));
+
+        if(forwardMaskImage)
+        {
+          const RealType maskValue = maskInterpolator->IsInsideBuffer(mappedPoint) ? maskInterpolator->Evaluate(mappedPoint) : maskExtrapolator->Evaluate(mappedPoint); // M_0(\phi_{10}(x))
+          forwardMaskImage->SetPixel(it.GetIndex(), static_cast<typename MaskImageType::PixelType>(maskValue));
+        }
+      }
+    }, nullptr);
+
+  m_ForwardImage = forwardImage;
+  if(forwardMaskImage)
+  {
+    m_ForwardMaskImage = forwardMaskImage;
+  }
+}
+
+template<typename TFixedImage, typename TMovingImage>
+typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::VirtualImagePointer
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+GetJacobianDeterminant(FieldPointer field)
+{
+  if(this->m_OutputTransform->GetLogJacobianDeterminant())
+  {
+    // Use log|D\phi_{t1}| transported by the integrator alongside \phi_{t1}
+    using ExpFilterType = ExpImageFilter<typename OutputTransformType::ScalarFieldType,VirtualImageType>;
+    typename ExpFilterType::Pointer expFilter = ExpFilterType::New();
+    expFilter->SetInput(this->m_OutputTransform->GetLogJacobianDeterminant()); // log|D\phi_{t1}|
+    expFilter->Update();
+    return expFilter->GetOutput(); // |D\phi_{t1}|
+  }
+
+  using JacobianDeterminantFilterType = DisplacementFieldJacobianDeterminantFilter<FieldType,RealType,VirtualImageType>;
+  typename JacobianDeterminantFilterType::Pointer jacobianDeterminantFilter = JacobianDeterminantFilterType::New();
+  jacobianDeterminantFilter->SetInput(field); // \phi_{t1}
+  jacobianDeterminantFilter->Update();
+  return jacobianDeterminantFilter->GetOutput(); // |D\phi_{t1}|
+}
+
 template<typename TFixedImage, typename TMovingImage>
 typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::FieldPointer
 MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
@@ -573,7 +1496,7 @@ GetMetricDerivative(FieldPointer field, bool useImageGradients)
   if(useImageGradients)
   {
     fixedImageGradientFilter = DefaultFixedImageGradientFilterType::New(); // \nabla I_1
-    movingImageGradientFilter = DefaultMovingImageGradientFilterType::New(); // \nabla I_0
+    movingImageGradientFilter = DefaultMovingImageGradientFilterType::New(); // \nabla I(1)
   }
   else
   {
@@ -581,7 +1504,18 @@ GetMetricDerivative(FieldPointer field, bool useImageGradients)
     movingImageGradientFilter = dynamic_cast<MovingImageGradientFilterType*>(m_MovingImageConstantGradientFilter.GetPointer()); // [1,1,1]
   }
 
-  /* Compute metric derivative p(t) \nabla I(t) */
+  /* Compute metric derivative p(t) \nabla I(t).
+     Without a field it's computed at t = 1, where the maps are the identity. */
+  const bool isIdentity = field.IsNull();
+  if(isIdentity)
+  {
+    field = FieldType::New();
+    field->CopyInformation(m_VirtualImage);
+    field->SetRegions(m_VirtualImage->GetLargestPossibleRegion());
+    field->Allocate();
+    field->FillBuffer(NumericTraits<VectorType>::ZeroValue()); // \phi_{11} = Id
+  }
+
   using DisplacementFieldTransformType = DisplacementFieldTransform<RealType,ImageDimension>;
   typename DisplacementFieldTransformType::Pointer fieldTransform = DisplacementFieldTransformType::New();
   fieldTransform->SetDisplacementField(field); // \phi_{t1}
@@ -604,7 +1538,7 @@ GetMetricDerivative(FieldPointer field, bool useImageGradients)
   metric->SetFixedImageGradientFilter(fixedImageGradientFilter);   // \nabla I_1
   metric->SetMovingImage(caster->GetOutput());                     // I(1)
   metric->SetMovingTransform(fieldTransform);                      // \phi_{t1}
-  metric->SetMovingImageGradientFilter(movingImageGradientFilter); // \nabla I_0
+  metric->SetMovingImageGradientFilter(movingImageGradientFilter); // \nabla I(1)
   metric->SetMovingImageMask(forwardMask);
   metric->SetVirtualDomainFromImage(m_VirtualImage);
   metric->Initialize();
@@ -636,15 +1570,11 @@ GetMetricDerivative(FieldPointer field, bool useImageGradients)
 
   using FieldMultiplierType = MultiplyImageFilter<FieldType,VirtualImageType>;
 
-  if(m_UseJacobian)
+  if(m_UseJacobian && !isIdentity)
   {
-    using JacobianDeterminantFilterType = DisplacementFieldJacobianDeterminantFilter<FieldType,RealType,VirtualImageType>;
-    typename JacobianDeterminantFilterType::Pointer jacobianDeterminantFilter = JacobianDeterminantFilterType::New();
-    jacobianDeterminantFilter->SetInput(this->m_OutputTransform->GetDisplacementField()); // \phi_{t1}
-
     typename FieldMultiplierType::Pointer multiplier0 = FieldMultiplierType::New();
-    multiplier0->SetInput1(importer->GetOutput());                  // -dM(I(1) o \phi{t1}, I_1 o \phi{t1})
-    multiplier0->SetInput2(jacobianDeterminantFilter->GetOutput()); // |D\phi_{t1}|
+    multiplier0->SetInput1(importer->GetOutput());        // -dM(I(1) o \phi{t1}, I_1 o \phi{t1})
+    multiplier0->SetInput2(GetJacobianDeterminant(field)); // |D\phi_{t1}|
     multiplier0->Update();
 
     metricDerivativeField = multiplier0->GetOutput();
@@ -652,10 +1582,79 @@ GetMetricDerivative(FieldPointer field, bool useImageGradients)
 
   typename FieldMultiplierType::Pointer multiplier1 = FieldMultiplierType::New();
   multiplier1->SetInput(metricDerivativeField);  // -dM(I(1) o \phi{t1}, I_1 o \phi{t1})
-  multiplier1->SetConstant(std::pow(m_Sigma,-2)); // 0.5 \sigma^{-2}
+  multiplier1->SetConstant(std::pow(m_Sigma,-2)); // \sigma^{-2}
   multiplier1->Update();
 
-  return multiplier1->GetOutput(); // p(t) \nabla I(t) = p(1, \phi{t1})  \nabla I(1, \phi{t1}) = -0.5 \sigma^{-2} -dM(I(1) o \phi{t1}, I_1 o \phi{t1})
+  return multiplier1->GetOutput(); // p(t) \nabla I(t) = p(1, \phi{t1})  \nabla I(1, \phi{t1}) = \sigma^{-2} -dM(I(1) o \phi{t1}, I_1 o \phi{t1})
+}
+
+template<typename TFixedImage, typename TMovingImage>
+typename MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::FieldPointer
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+TransportMetricDerivative(FieldPointer metricDerivative, FieldPointer field, bool useImageGradients)
+{
+  /* Compute p(t) \nabla I(t) = |D\phi_{t1}| D\phi_{t1}^T p(1, \phi_{t1}) \nabla I(1, \phi_{t1}) in a single pass.
+     The bias derivative, p(t) [1,1,1] = |D\phi_{t1}| p(1, \phi_{t1}) [1,1,1], has no D\phi_{t1}^T factor. */
+  using DisplacementFieldTransformType = DisplacementFieldTransform<RealType,ImageDimension>;
+  typename DisplacementFieldTransformType::Pointer transform = DisplacementFieldTransformType::New();
+  transform->SetDisplacementField(field); // \phi_{t1}
+
+  using InterpolatorType = VectorLinearInterpolateImageFunction<FieldType, RealType>;
+  typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+  interpolator->SetInputImage(metricDerivative); // p(1) \nabla I(1)
+
+  // ITK dense transforms always return identity for jacobian with respect to parameters.
+  // ... so we provide an option to use it here.
+  VirtualImagePointer jacobianDeterminant;
+  if(m_UseJacobian)
+  {
+    jacobianDeterminant = GetJacobianDeterminant(field); // |D\phi_{t1}|
+  }
+
+  FieldPointer transportedDerivative = FieldType::New();
+  transportedDerivative->CopyInformation(m_VirtualImage);
+  transportedDerivative->SetRegions(m_VirtualImage->GetLargestPossibleRegion());
+  transportedDerivative->Allocate();
+
+  MultiThreaderBase::Pointer threader = MultiThreaderBase::New();
+  threader->ParallelizeImageRegion<ImageDimension>(transportedDerivative->GetLargestPossibleRegion(),
+    [&](const typename FieldType::RegionType & region)
+    {
+      typename DisplacementFieldTransformType::JacobianPositionType jacobian;
+      ImageRegionIteratorWithIndex<FieldType> it(transportedDerivative, region);
+      for(it.GoToBegin(); !it.IsAtEnd(); ++it)
+      {
+        typename DisplacementFieldTransformType::InputPointType point;
+        transportedDerivative->TransformIndexToPhysicalPoint(it.GetIndex(), point); // x
+        const typename DisplacementFieldTransformType::OutputPointType mappedPoint = transform->TransformPoint(point); // \phi_{t1}(x)
+
+        // Metric derivative vanishes outside the virtual domain
+        VectorType value(0.0);
+        if(interpolator->IsInsideBuffer(mappedPoint))
+        {
+          const typename InterpolatorType::OutputType interpolatedValue = interpolator->Evaluate(mappedPoint); // p(1, \phi_{t1}(x)) \nabla I(1, \phi_{t1}(x))
+          if(useImageGradients)
+          {
+            transform->ComputeJacobianWithRespectToPosition(it.GetIndex(), jacobian); // D\phi_{t1}(x)
+            for(unsigned int i = 0; i < ImageDimension; i++)
+            {
+              for(unsigned int k = 0; k < ImageDimension; k++){ value[i] += jacobian(k,i) * interpolatedValue[k]; } // D\phi_{t1}(x)^T p(1, \phi_{t1}(x)) \nabla I(1, \phi_{t1}(x))
+            }
+          }
+          else
+          {
+            for(unsigned int i = 0; i < ImageDimension; i++){ value[i] = interpolatedValue[i]; }
+          }
+        }
+        if(jacobianDeterminant)
+        {
+          value *= jacobianDeterminant->GetPixel(it.GetIndex()); // |D\phi_{t1}(x)|
+        }
+        it.Set(value);
+      }
+    }, nullptr);
+
+  return transportedDerivative; // p(t) \nabla I(t)
 }
 
 template<typename TFixedImage, typename TMovingImage>
@@ -663,12 +1662,47 @@ void
 MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
 UpdateControls()
 {
+  using TimeVaryingFieldAdderType = AddImageFilter<TimeVaryingFieldType>;
+  using TimeVaryingImageMultiplierType = MultiplyImageFilter<TimeVaryingImageType,TimeVaryingImageType>;
+  using TimeVaryingImageAdderType = AddImageFilter<TimeVaryingImageType>;
+  using ImageMultiplierType = MultiplyImageFilter<VirtualImageType,VirtualImageType>;
+  using ImageAdderType = AddImageFilter<VirtualImageType>;
+
+  TimeVaryingFieldPointer velocityEnergyGradient;
+  VelocityBandType        velocityBandEnergyGradient;
+  TimeVaryingImagePointer rateEnergyGradient;
+  VirtualImagePointer     momentumEnergyGradient;
+
+  // Save accepted state so that a rejected step can be undone without recomputation.
+  // This must precede the gradient computation, which replaces \phi_{10} with \phi_{t1}.
+  SaveState();
+
+  // Transport |D\phi_{t1}| while integrating the maps used by the gradient
+  this->m_OutputTransform->SetCalculateLogJacobianDeterminant(m_UseJacobian);
+
   using FieldJoinerType = JoinSeriesImageFilter<FieldType,TimeVaryingFieldType>;
   typename FieldJoinerType::Pointer velocityJoiner = FieldJoinerType::New();
 
   using ImageJoinerType = JoinSeriesImageFilter<VirtualImageType,TimeVaryingImageType>;
   typename ImageJoinerType::Pointer rateJoiner = ImageJoinerType::New();
 
+  // Local NCC derivatives are computed once at t = 1 and transported to each time step,
+  // instead of recomputing the window sums at every time step
+  using LocalNormalizedCrossCorrelationMetricType = LocalNormalizedCrossCorrelationImageToImageMetricv4<FixedImageType, MovingImageType,
+    typename ImageMetricType::VirtualImageType, typename ImageMetricType::InternalComputationValueType, MetricTraits>;
+  const bool transportMetricDerivative = dynamic_cast<LocalNormalizedCrossCorrelationMetricType*>(this->m_Metric.GetPointer()) != nullptr;
+
+  FieldPointer metricDerivative;
+  FieldPointer biasMetricDerivative;
+  if(transportMetricDerivative)
+  {
+    metricDerivative = GetMetricDerivative(nullptr, true); // p(1) \nabla I(1)
+    if(m_UseBias)
+    {
+      biasMetricDerivative = GetMetricDerivative(nullptr, false); // p(1) [1,1,1]
+    }
+  }
+
   // For each time step
   for(unsigned int j = 0; j < m_NumberOfTimeSteps; j++)
   {
@@ -676,27 +1710,36 @@ UpdateControls()
 
     //std::cout<<"Before integrate"<<std::endl; /***/
     // Compute reverse mapping, \phi_{t1} by integrating velocity field, v(t).
-    if(j == m_NumberOfTimeSteps-1)
+    // Equal time bounds give the identity, \phi_{11} = Id, with log|D\phi_{11}| = 0, in a new field.
+    this->m_OutputTransform->SetNumberOfIntegrationSteps((m_NumberOfTimeSteps-1-j) + 2);
+    this->m_OutputTransform->SetLowerTimeBound(j == m_NumberOfTimeSteps-1 ? 1.0 : t);
+    this->m_OutputTransform->SetUpperTimeBound(1.0);
+    this->m_OutputTransform->IntegrateVelocityField();
+
+    //std::cout<<"After integrate"<<std::endl; /***/
+    FieldPointer field = this->m_OutputTransform->GetDisplacementField(); // \phi_{t1}
+    if(transportMetricDerivative)
     {
-      this->m_OutputTransform->GetModifiableDisplacementField()->FillBuffer(NumericTraits<VectorType>::ZeroValue());
+      velocityJoiner->PushBackInput(TransportMetricDerivative(metricDerivative, field, true)); // p(t) \nabla I(t) = |D\phi_{t1}| D\phi_{t1}^T p(1, \phi{t1}) \nabla I(1, \phi{t1})
     }
     else
     {
-      this->m_OutputTransform->SetNumberOfIntegrationSteps((m_NumberOfTimeSteps-1-j) + 2);
-      this->m_OutputTransform->SetLowerTimeBound(t);
-      this->m_OutputTransform->SetUpperTimeBound(1.0);
-      this->m_OutputTransform->IntegrateVelocityField();
+      velocityJoiner->PushBackInput(GetMetricDerivative(field, true)); // p(t) \nabla I(t) =  p(1, \phi{t1})  \nabla I(1, \phi{t1})
     }
-
-    //std::cout<<"After integrate"<<std::endl; /***/
-    velocityJoiner->PushBackInput(GetMetricDerivative(this->m_OutputTransform->GetDisplacementField(), true)); // p(t) \nabla I(t) =  p(1, \phi{t1})  \nabla I(1, \phi{t1})
     //std::cout<<"After compute derivative"<<std::endl; /***/
 
     if(m_UseBias)
     {
       using ComponentExtractorType = VectorIndexSelectionCastImageFilter<FieldType, VirtualImageType>;
       typename ComponentExtractorType::Pointer componentExtractor = ComponentExtractorType::New();
-      componentExtractor->SetInput(GetMetricDerivative(this->m_OutputTransform->GetDisplacementField(), false)); // p(t) [1,1,1] = p(t) \nabla I(t) [1,1,1]
+      if(transportMetricDerivative)
+      {
+        componentExtractor->SetInput(TransportMetricDerivative(biasMetricDerivative, field, false)); // p(t) [1,1,1] = |D\phi_{t1}| p(1, \phi{t1}) [1,1,1]
+      }
+      else
+      {
+        componentExtractor->SetInput(GetMetricDerivative(field, false)); // p(t) [1,1,1] = p(t) \nabla I(t) [1,1,1]
+      }
       componentExtractor->SetIndex(0);
       componentExtractor->Update();
 
@@ -708,18 +1751,22 @@ UpdateControls()
 
   // Compute velocity energy gradient, \nabla_V E = v + K_V [p \nabla I]
   //std::cout<<"Before Apply Kernel"<<std::endl;  /***/
-  using TimeVaryingFieldAdderType = AddImageFilter<TimeVaryingFieldType>;
-  typename TimeVaryingFieldAdderType::Pointer adder0 = TimeVaryingFieldAdderType::New();
-  adder0->SetInput1(this->m_OutputTransform->GetVelocityField());                 // v
-  adder0->SetInput2(ApplyKernel(m_VelocityKernel,velocityJoiner->GetOutput()));   // K_V[p \nabla I]
-  adder0->Update();
-  TimeVaryingFieldPointer velocityEnergyGradient = adder0->GetOutput();           // \nabla_V E = v + K_V[p \nabla I]
+  if(m_UseBandLimitedVelocity)
+  {
+    // Project gradient onto band, \nabla_{\hat{v}} E = \hat{v} + K_V \hat{[p \nabla I]}
+    velocityBandEnergyGradient = CombineVelocityBands(m_VelocityBand, ProjectOntoVelocityBand(velocityJoiner->GetOutput()), 1.0, m_VelocityKernel);
+  }
+  else
+  {
+    typename TimeVaryingFieldAdderType::Pointer adder0 = TimeVaryingFieldAdderType::New();
+    adder0->SetInput1(this->m_OutputTransform->GetVelocityField());                 // v
+    adder0->SetInput2(ApplyKernel(m_VelocityKernel,velocityJoiner->GetOutput()));   // K_V[p \nabla I]
+    adder0->Update();
+    velocityEnergyGradient = adder0->GetOutput();                                   // \nabla_V E = v + K_V[p \nabla I]
+  }
   //std::cout<<"After Apply Kernel"<<std::endl; /***/
 
   // Compute rate energy gradient \nabla_r E = r - \mu^2 K_R[p]
-  using TimeVaryingImageMultiplierType = MultiplyImageFilter<TimeVaryingImageType,TimeVaryingImageType>;
-  using TimeVaryingImageAdderType = AddImageFilter<TimeVaryingImageType>;
-  TimeVaryingImagePointer rateEnergyGradient;
   if(m_UseBias)
   {
     rateJoiner->Update();
@@ -736,26 +1783,133 @@ UpdateControls()
     rateEnergyGradient = adder1->GetOutput();      // \nabla_R E = r - \mu^2 K_R[p]
   }
 
-  //std::cout<<"Before GetEnergy"<<std::endl;  /***/
-  double                  energyOld = GetEnergy();
-  //std::cout<<"After GetEnergy"<<std::endl;  /***/
-  TimeVaryingFieldPointer velocityOld = this->m_OutputTransform->GetVelocityField();
-  TimeVaryingImagePointer rateOld = m_Rate;
+  // Pull velocity energy gradient back to initial momentum
+  if(m_UseGeodesicShooting)
+  {
+    /* With v(t) = -K_V[p(t) \nabla I(t)], p(t) = |D\phi_{t0}| p_0 o \phi_{t0} and the maps held fixed,
+       \nabla_{p_0} E = -\Delta t \sum_j h_j o \phi_{0t_j}, where h_j = \nabla_V E(t_j) \cdot \nabla I(t_j).
+       This is an approximate gradient, not the true adjoint, since the dependence of the maps and of I(t) on p_0 is ignored.
+       At t = 0 this includes the velocity energy term, -\nabla I_0 \cdot K_V[p_0 \nabla I_0].
+       The sum is accumulated backward in time, S_j = h_j + S_{j+1} o \phi_{t_j t_{j+1}},
+       so only one time step is integrated per time point. */
+    const typename VirtualImageType::RegionType virtualRegion = m_VirtualImage->GetLargestPossibleRegion();
+
+    using GradientFilterType = GradientImageFilter<VirtualImageType, RealType, RealType>;
+    using InterpolatorType = LinearInterpolateImageFunction<VirtualImageType, RealType>;
+    using ExtrapolatorType = WrapExtrapolateImageFunction<VirtualImageType, RealType>;
 
-  while(this->GetLearningRate() > m_MinLearningRate && GetImageEnergyFraction() > m_MinImageEnergyFraction)
+    VirtualImagePointer adjoint; // S_{j+1}
+    for(int j = m_NumberOfTimeSteps - 1; j >= 0; j--)
+    {
+      FieldPointer energyGradientSlice = ExtractSlice(velocityEnergyGradient, j); // \nabla_V E(t_j)
+
+      typename GradientFilterType::Pointer gradientFilter = GradientFilterType::New();
+      gradientFilter->SetInput(ExtractSlice(m_ImageTrajectory, j)); // I(t_j)
+      gradientFilter->Update();                                     // \nabla I(t_j)
+      const typename GradientFilterType::OutputImageType * gradient = gradientFilter->GetOutput();
+
+      // Integrate one step forward in time, \phi_{t_j t_{j+1}}
+      FieldPointer stepDisplacement;
+      typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
+      typename ExtrapolatorType::Pointer extrapolator = ExtrapolatorType::New();
+      if(adjoint)
+      {
+        stepDisplacement = IntegrateTimeStep(ExtractSlice(this->m_OutputTransform->GetVelocityField(), j), m_TimeStep);
+        interpolator->SetInputImage(adjoint);
+        extrapolator->SetInputImage(adjoint);
+      }
+
+      VirtualImagePointer newAdjoint = VirtualImageType::New();
+      newAdjoint->CopyInformation(m_VirtualImage);
+      newAdjoint->SetRegions(virtualRegion);
+      newAdjoint->Allocate();
+
+      MultiThreaderBase::Pointer threader = MultiThreaderBase::New();
+      threader->ParallelizeImageRegion<ImageDimension>(virtualRegion,
+        [&](const typename VirtualImageType::RegionType & region)
+        {
+          ImageRegionIteratorWithIndex<VirtualImageType> it(newAdjoint, region);
+          for(it.GoToBegin(); !it.IsAtEnd(); ++it)
+          {
+            const VectorType energyGradient = energyGradientSlice->GetPixel(it.GetIndex());
+            const typename GradientFilterType::OutputPixelType imageGradient = gradient->GetPixel(it.GetIndex());
+
+            RealType value = 0;
+            for(unsigned int i = 0; i < ImageDimension; i++){ value += energyGradient[i] * imageGradient[i]; } // h_j
+
+            if(stepDisplacement)
+            {
+              typename FieldType::PointType point;
+              newAdjoint->TransformIndexToPhysicalPoint(it.GetIndex(), point); // x
+              const typename FieldType::PointType stepPoint = point + stepDisplacement->GetPixel(it.GetIndex()); // \phi_{t_j t_{j+1}}(x)
+              value += interpolator->IsInsideBuffer(stepPoint) ? interpolator->Evaluate(stepPoint) : extrapolator->Evaluate(stepPoint); // h_j + S_{j+1} o \phi_{t_j t_{j+1}}
+            }
+            it.Set(static_cast<VirtualPixelType>(value));
+          }
+        }, nullptr);
+
+      adjoint = newAdjoint; // S_j
+    }
+
+    typename ImageMultiplierType::Pointer multiplier0 = ImageMultiplierType::New();
+    multiplier0->SetInput(adjoint);                  // S_0
+    multiplier0->SetConstant(-m_TimeStep);           // -\Delta t
+    multiplier0->Update();
+    momentumEnergyGradient = multiplier0->GetOutput(); // \nabla_{p_0} E = -\Delta t S_0
+  }
+
+  this->m_OutputTransform->SetCalculateLogJacobianDeterminant(false);
+
+  // Shooting only needs the velocity gradient for the momentum gradient, so it's released there
+  if(m_UseGeodesicShooting)
   {
-    // Update velocity, v = v - \epsilon \nabla_V E
-    using TimeVaryingFieldMultiplierType = MultiplyImageFilter<TimeVaryingFieldType,TimeVaryingImageType>;
-    typename TimeVaryingFieldMultiplierType::Pointer multiplier2 = TimeVaryingFieldMultiplierType::New();
-    multiplier2->SetInput(velocityEnergyGradient);                   // \nabla_V E
-    multiplier2->SetConstant(-this->GetLearningRate());              // -\epsilon
+    velocityEnergyGradient = nullptr;
+  }
 
-    typename TimeVaryingFieldAdderType::Pointer adder2 = TimeVaryingFieldAdderType::New();
-    adder2->SetInput1(this->m_OutputTransform->GetVelocityField());   // v
-    adder2->SetInput2(multiplier2->GetOutput());                      // -\epsilon \nabla_V E
-    adder2->Update();
+  double energyOld = m_Energy;
 
-    this->m_OutputTransform->SetVelocityField(adder2->GetOutput());  // v = v - \epsilon \nabla_V E
+  while(this->GetLearningRate() > m_MinLearningRate && GetImageEnergyFraction() > m_MinImageEnergyFraction)
+  {
+    // Controls are at their last accepted values here so it's safe to stop
+    if(IsStopRequested()){ return; }
+
+    if(m_UseGeodesicShooting)
+    {
+      // Update initial momentum, p_0 = p_0 - \epsilon \nabla_{p_0} E
+      typename ImageMultiplierType::Pointer multiplier2 = ImageMultiplierType::New();
+      multiplier2->SetInput(momentumEnergyGradient);         // \nabla_{p_0} E
+      multiplier2->SetConstant(-this->GetLearningRate());    // -\epsilon
+
+      typename ImageAdderType::Pointer adder2 = ImageAdderType::New();
+      adder2->SetInput1(m_InitialMomentum);                  // p_0
+      adder2->SetInput2(multiplier2->GetOutput());           // -\epsilon \nabla_{p_0} E
+      adder2->Update();
+      m_InitialMomentum = adder2->GetOutput();               // p_0 = p_0 - \epsilon \nabla_{p_0} E
+
+      // Generate v from p_0
+      Shoot();
+    }
+    else if(m_UseBandLimitedVelocity)
+    {
+      // Update velocity spectrum, \hat{v} = \hat{v} - \epsilon \nabla_{\hat{v}} E, and synthesize v from it
+      m_VelocityBand = CombineVelocityBands(m_VelocityBand, velocityBandEnergyGradient, -this->GetLearningRate());
+      this->m_OutputTransform->SetVelocityField(SynthesizeFromVelocityBand(m_VelocityBand));
+    }
+    else
+    {
+      // Update velocity, v = v - \epsilon \nabla_V E
+      using TimeVaryingFieldMultiplierType = MultiplyImageFilter<TimeVaryingFieldType,TimeVaryingImageType>;
+      typename TimeVaryingFieldMultiplierType::Pointer multiplier2 = TimeVaryingFieldMultiplierType::New();
+      multiplier2->SetInput(velocityEnergyGradient);                   // \nabla_V E
+      multiplier2->SetConstant(-this->GetLearningRate());              // -\epsilon
+
+      typename TimeVaryingFieldAdderType::Pointer adder2 = TimeVaryingFieldAdderType::New();
+      adder2->SetInput1(this->m_OutputTransform->GetVelocityField());   // v
+      adder2->SetInput2(multiplier2->GetOutput());                      // -\epsilon \nabla_V E
+      adder2->Update();
+
+      this->m_OutputTransform->SetVelocityField(adder2->GetOutput());  // v = v - \epsilon \nabla_V E
+    }
 
     // Compute forward mapping \phi{10} by integrating velocity field v(t)
     this->m_OutputTransform->SetNumberOfIntegrationSteps((m_NumberOfTimeSteps -1) + 2);
@@ -767,42 +1921,6 @@ UpdateControls()
     typename DisplacementFieldTransformType::Pointer transform = DisplacementFieldTransformType::New();
     transform->SetDisplacementField(this->m_OutputTransform->GetDisplacementField()); // \phi_{t1}
 
-    // Compute forward image I(1) = I_0 o \phi_{10} + B(1)
-    using ExtrapolatorType = WrapExtrapolateImageFunction<MovingImageType, RealType>;
-    using MovingResamplerType = ResampleImageFilter<MovingImageType,VirtualImageType,RealType>;
-    typename MovingResamplerType::Pointer resampler = MovingResamplerType::New();
-    resampler->SetInput(this->GetMovingImage());   // I_0
-    resampler->SetTransform(transform);            // \phi_{t0}
-    resampler->UseReferenceImageOn();
-    resampler->SetReferenceImage(this->GetFixedImage());
-    resampler->SetExtrapolator(ExtrapolatorType::New());
-    resampler->Update();
-
-    m_ForwardImage = resampler->GetOutput();       // I_0 o \phi_{10}
-
-    // Compute forward mask M(1) = M_0 o \phi{1_0}
-    if(m_ForwardMaskImage)
-    {
-      using MaskInterpolatorType = NearestNeighborInterpolateImageFunction<MaskImageType, RealType>;
-      typename MaskInterpolatorType::Pointer maskInterpolator = MaskInterpolatorType::New();
-
-      using MaskExtrapolatorType = WrapExtrapolateImageFunction<MaskImageType, RealType>;
-      typename MaskExtrapolatorType::Pointer maskExtrapolator = MaskExtrapolatorType::New();
-      maskExtrapolator->SetInterpolator(maskInterpolator);
-
-      using MaskResamplerType = ResampleImageFilter<MaskImageType,MaskImageType,RealType>;
-      typename MaskResamplerType::Pointer maskResampler = MaskResamplerType::New();
-      maskResampler->SetInput(m_MovingMaskImage);  // M_0
-      maskResampler->SetTransform(transform);      // \phi_{10}
-      maskResampler->UseReferenceImageOn();
-      maskResampler->SetReferenceImage(this->GetFixedImage());
-      maskResampler->SetInterpolator(maskInterpolator);
-      maskResampler->SetExtrapolator(maskExtrapolator);
-      maskResampler->Update();
-
-      m_ForwardMaskImage = maskResampler->GetOutput(); // M_0 o \phi_{10}
-    }
-
     if(m_UseBias)
     {
       // Update rate, r = r - \epsilon \nabla_R E
@@ -816,17 +1934,12 @@ UpdateControls()
       adder3->Update();
 
       m_Rate = adder3->GetOutput(); // r = r - \epsilon \nabla_R E  */
-      IntegrateRate();
-
-      using AdderType = AddImageFilter<VirtualImageType>;
-      typename AdderType::Pointer biasAdder = AdderType::New();
-      biasAdder->SetInput1(m_ForwardImage);    // I_0 o \phi_{10}
-      biasAdder->SetInput2(GetBias());         // B(1)
-      biasAdder->Update();
-
-      m_ForwardImage = biasAdder->GetOutput(); // I_0 o \phi_{10} + B(1)
+      IntegrateRate();  // B(1)
     }
 
+    // Compute forward image I(1) = I_0 o \phi_{10} + B(1) and mask M(1) = M_0 o \phi_{10}
+    WarpForward(transform->GetModifiableDisplacementField());
+
     m_RecalculateEnergy = true;
 
     typename VirtualImageType::IndexType centerIndex;
@@ -836,9 +1949,7 @@ UpdateControls()
     {
       // ...restore the controls to their previous values and decrease learning rate
       this->SetLearningRate(0.5*this->GetLearningRate());
-      this->m_OutputTransform->SetVelocityField(velocityOld);
-      m_Rate = rateOld;
-      m_RecalculateEnergy = true;
+      RestoreState();
     }
     else // If energy decreased...
     {
@@ -853,16 +1964,87 @@ UpdateControls()
   m_IsConverged = true;
 }
 
+template<typename TFixedImage, typename TMovingImage>
+double
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+GetVelocityQuantizationError() const
+{
+  if(!this->m_OutputTransform->GetQuantizedVelocityField()){ return 0; }
+  return this->m_OutputTransform->GetQuantizedVelocityField()->GetRelativeError(); // ||v - Q(v)|| / ||v||
+}
+
+template<typename TFixedImage, typename TMovingImage>
+void
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+StopOptimization()
+{
+  m_StopRequested = true;
+}
+
+template<typename TFixedImage, typename TMovingImage>
+bool
+MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
+IsStopRequested()
+{
+  m_ElapsedTime = m_Clock->GetTimeInSeconds() - m_StartTime;
+
+  if(m_StopRequested)
+  {
+    m_StopConditionDescription = "Optimization stopped by request";
+    return true;
+  }
+
+  if(m_MaximumElapsedTime > 0 && m_ElapsedTime > m_MaximumElapsedTime)
+  {
+    m_StopConditionDescription = "Maximum elapsed time exceeded";
+    return true;
+  }
+
+  return false;
+}
+
 template<typename TFixedImage, typename TMovingImage>
 void
 MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
 StartOptimization()
 {
   this->InvokeEvent(StartEvent());
+
+  this->m_IsConverged = false;
+  m_StopConditionDescription = "Maximum number of iterations reached";
+
+  // Energies of the last ConvergenceWindowSize + 1 iterations
+  std::deque<double> energies;
+  energies.push_back(GetEnergy());
+
   for(this->m_CurrentIteration = 0; this->m_CurrentIteration < m_NumberOfIterations; this->m_CurrentIteration++)
   {
+    if(IsStopRequested()){ break; }
+
     UpdateControls();
-    if(this->m_IsConverged){ break; }
+    if(IsStopRequested()){ break; }
+    if(this->m_IsConverged)
+    {
+      m_StopConditionDescription = "Learning rate or image energy fraction below minimum";
+      break;
+    }
+
+    // Check relative decrease of energy over window, (E_{k-W} - E_k) / max(|E_{k-W}|, \epsilon)
+    energies.push_back(GetEnergy());
+    if(energies.size() > this->GetConvergenceWindowSize() + 1){ energies.pop_front(); }
+    if(this->GetConvergenceThreshold() > 0 && this->GetConvergenceWindowSize() > 0 && energies.size() == this->GetConvergenceWindowSize() + 1)
+    {
+      const double energyScale = std::max(std::abs(energies.front()), NumericTraits<double>::epsilon());
+      double relativeEnergyChange = (energies.front() - energies.back()) / energyScale;
+      if(relativeEnergyChange < this->GetConvergenceThreshold())
+      {
+        m_StopConditionDescription = "Relative energy change over convergence window below threshold";
+        this->m_IsConverged = true;
+        this->InvokeEvent(IterationEvent());
+        break;
+      }
+    }
+
     this->InvokeEvent(IterationEvent());
   }
 }
@@ -872,10 +2054,18 @@ void
 MetamorphosisImageRegistrationMethodv4<TFixedImage, TMovingImage>::
 GenerateData()
 {
+  // Time budget includes initialization.
+  // A stop requested before the run is honored, so the request is only cleared when the run ends.
+  m_StartTime = m_Clock->GetTimeInSeconds();
+  m_ElapsedTime = 0;
+  this->m_CurrentIteration = 0;
+
   this->m_OutputTransform->UseInverseOff();
+  this->m_OutputTransform->SetUseQuantizedVelocity(m_UseQuantizedVelocity);
   Initialize();
-  StartOptimization();
+  if(!IsStopRequested()){ StartOptimization(); }
   this->m_OutputTransform->UseInverseOn();
+  this->m_OutputTransform->UseQuantizedVelocityOff();
 
   // Integrate rate to get final bias, B(1)
   if(m_UseBias) { IntegrateRate(); }
@@ -886,6 +2076,7 @@ GenerateData()
   this->m_OutputTransform->SetUpperTimeBound(0.0);
   this->m_OutputTransform->IntegrateVelocityField();
   this->GetTransformOutput()->Set(this->m_OutputTransform);
+  m_StopRequested = false;
 
   this->InvokeEvent(EndEvent());
 }
@@ -898,6 +2089,15 @@ PrintSelf(std::ostream& os, Indent indent ) const
   ProcessObject::PrintSelf(os, indent);
   os<<indent<<"Velocity Smoothness: " <<m_RegistrationSmoothness<<std::endl;
   os<<indent<<"Bias Smoothness: "<<m_BiasSmoothness<<std::endl;
+  os<<indent<<"Use Band Limited Velocity: "<<m_UseBandLimitedVelocity<<std::endl;
+  os<<indent<<"Velocity Band Fraction: "<<m_VelocityBandFraction<<std::endl;
+  os<<indent<<"Use Geodesic Shooting: "<<m_UseGeodesicShooting<<std::endl;
+  os<<indent<<"Maximum Elapsed Time: "<<m_MaximumElapsedTime<<std::endl;
+  os<<indent<<"Use FFT Size Autotuning: "<<m_UseFFTSizeAutotuning<<std::endl;
+  os<<indent<<"Maximum Padding Fraction: "<<m_MaximumPaddingFraction<<std::endl;
+  os<<indent<<"FFT Size Cache File Name: "<<m_FFTSizeCacheFileName<<std::endl;
+  os<<indent<<"Use Quantized Velocity: "<<m_UseQuantizedVelocity<<std::endl;
+  os<<indent<<"Stop Condition: "<<m_StopConditionDescription<<std::endl;
 }
 
 
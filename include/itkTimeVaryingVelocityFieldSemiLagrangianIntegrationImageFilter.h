@@ -21,6 +21,9 @@
 #include "itkExtrapolateImageFunction.h"
 #include "itkWrapExtrapolateImageFunction.h"
 #include "itkTimeVaryingVelocityFieldIntegrationImageFilter.h"
+#include "itkBlockQuantizedVectorField.h"
+#include <memory>
+#include <mutex>
 
 namespace itk
 {
@@ -82,6 +85,21 @@ public:
   using DisplacementFieldExtrapolatorType = ExtrapolateImageFunction<DisplacementFieldType, ScalarType>;
   using DisplacementFieldExtrapolatorPointer = typename DisplacementFieldExtrapolatorType::Pointer;
 
+  using ScalarFieldType = Image<ScalarType, OutputImageDimension>;
+  using ScalarFieldPointer = typename ScalarFieldType::Pointer;
+  using TimeVaryingScalarFieldType = Image<ScalarType, InputImageDimension>;
+  using TimeVaryingScalarFieldPointer = typename TimeVaryingScalarFieldType::Pointer;
+  using TimeVaryingScalarFieldConstPointer = typename TimeVaryingScalarFieldType::ConstPointer;
+
+  using QuantizedVelocityFieldType = BlockQuantizedVectorField<TimeVaryingVelocityFieldType>;
+  using QuantizedVelocityFieldConstPointer = typename QuantizedVelocityFieldType::ConstPointer;
+  using QuantizedVelocityCacheType = typename QuantizedVelocityFieldType::DecodeCache;
+
+  using DivergenceInterpolatorType = LinearInterpolateImageFunction<TimeVaryingScalarFieldType, ScalarType>;
+  using DivergenceInterpolatorPointer = typename DivergenceInterpolatorType::Pointer;
+  using DivergenceExtrapolatorType = WrapExtrapolateImageFunction<TimeVaryingScalarFieldType, ScalarType>;
+  using DivergenceExtrapolatorPointer = typename DivergenceExtrapolatorType::Pointer;
+
   /**
    * Get/Set the time-varying velocity field extrapolator.  Default = linear. 
    */
@@ -100,6 +118,46 @@ public:
    */
   itkGetConstMacro( NumberOfIterations, unsigned int );
 
+  /**
+   * Transport the log of the Jacobian determinant of the map along the
+   * flow, d/dt log|D\phi| = div v, in the same pass that integrates the
+   * displacement.  The initial diffeomorphism's Jacobian is not included.
+   * Default = false.
+   */
+  itkBooleanMacro( CalculateLogJacobianDeterminant );
+  itkSetMacro( CalculateLogJacobianDeterminant, bool );
+  itkGetConstMacro( CalculateLogJacobianDeterminant, bool );
+
+  /**
+   * Get the log of the Jacobian determinant computed with the displacement.
+   */
+  itkGetModifiableObjectMacro( LogJacobianDeterminant, ScalarFieldType );
+
+  /**
+   * Set/Get the divergence of the velocity used to transport the log of the
+   * Jacobian determinant.  It is computed from the input unless one computed
+   * since the input was last modified is set, so that it can be reused by
+   * integrations of the same velocity.  It isn't needed when the time bounds
+   * are equal.
+   */
+  itkSetConstObjectMacro( VelocityDivergence, TimeVaryingScalarFieldType );
+  itkGetConstObjectMacro( VelocityDivergence, TimeVaryingScalarFieldType );
+
+  /**
+   * Sample the velocity from a 16-bit block-quantized copy with linear
+   * interpolation, decoding blocks into small caches.  Each work unit takes
+   * a cache from a pool and returns it when done, so caches are reused across
+   * work units and there are only as many as run concurrently.  The copy is
+   * made from the input unless one of matching size, quantized since the
+   * input was last modified, is set.
+   * Default = false.
+   */
+  itkBooleanMacro( UseQuantizedVelocity );
+  itkSetMacro( UseQuantizedVelocity, bool );
+  itkGetConstMacro( UseQuantizedVelocity, bool );
+  itkSetConstObjectMacro( QuantizedVelocityField, QuantizedVelocityFieldType );
+  itkGetConstObjectMacro( QuantizedVelocityField, QuantizedVelocityFieldType );
+
 
 protected:
   TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter();
@@ -107,8 +165,13 @@ protected:
 
   void PrintSelf( std::ostream & os, Indent indent ) const override;
   void BeforeThreadedGenerateData() override;
-  void ThreadedGenerateData( const OutputRegionType &, ThreadIdType ) override;
+  void DynamicThreadedGenerateData( const OutputRegionType & ) override;
   VectorType IntegrateVelocityAtPoint( const PointType &initialSpatialPoint, const TimeVaryingVelocityFieldType * inputField );
+  VectorType IntegrateVelocityAtPoint( const PointType &initialSpatialPoint, const TimeVaryingVelocityFieldType * inputField, RealType * logJacobianDeterminant, QuantizedVelocityCacheType * velocityCache );
+  VectorType EvaluateQuantizedVelocity( const typename TimeVaryingVelocityFieldType::PointType & spaceTimePoint, const TimeVaryingVelocityFieldType * inputField, QuantizedVelocityCacheType & velocityCache ) const;
+  std::unique_ptr<QuantizedVelocityCacheType> AcquireQuantizedVelocityCache();
+  void ReleaseQuantizedVelocityCache( std::unique_ptr<QuantizedVelocityCacheType> velocityCache );
+  TimeVaryingScalarFieldPointer CalculateVelocityDivergence();
 
   DisplacementFieldExtrapolatorPointer      m_DisplacementFieldExtrapolator;
  
@@ -120,6 +183,15 @@ private:
   RealType                                  m_DeltaTime;
   RealType                                  m_TimeSpan;
   RealType                                  m_TimeOrigin;
+  bool                                      m_CalculateLogJacobianDeterminant;
+  bool                                      m_UseQuantizedVelocity;
+  QuantizedVelocityFieldConstPointer        m_QuantizedVelocityField;
+  std::vector<std::unique_ptr<QuantizedVelocityCacheType>> m_QuantizedVelocityCaches;
+  std::mutex                                m_QuantizedVelocityCacheMutex;
+  ScalarFieldPointer                        m_LogJacobianDeterminant;
+  TimeVaryingScalarFieldConstPointer        m_VelocityDivergence;
+  DivergenceInterpolatorPointer             m_DivergenceInterpolator;
+  DivergenceExtrapolatorPointer             m_DivergenceExtrapolator;
 };
 }
 
@@ -22,6 +22,7 @@
 
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkVectorLinearInterpolateImageFunction.h"
+#include <algorithm>
 
 namespace itk
 {
@@ -39,7 +40,10 @@ TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
   this->m_NumberOfIntegrationSteps = 100;
   this->m_NumberOfIterations = 10;
   this->m_NumberOfTimePoints = 0;
+  this->m_CalculateLogJacobianDeterminant = false;
+  this->m_UseQuantizedVelocity = false;
   this->SetNumberOfRequiredInputs( 1 );
+  this->DynamicMultiThreadingOn();
 
   if( InputImageDimension - 1 != OutputImageDimension )
     {
@@ -58,6 +62,9 @@ TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
 
   using DefaultDisplacementFieldExtrapolatorType = WrapExtrapolateImageFunction<DisplacementFieldType, ScalarType>;
   this->SetDisplacementFieldExtrapolator(DefaultDisplacementFieldExtrapolatorType::New());
+
+  this->m_DivergenceInterpolator = DivergenceInterpolatorType::New();
+  this->m_DivergenceExtrapolator = DivergenceExtrapolatorType::New();
 }
 
 template<typename TTimeVaryingVelocityField, typename TDisplacementField>
@@ -95,40 +102,196 @@ TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
 
   // Calculate the delta time used for integration
   m_DeltaTime = (this->m_UpperTimeBound - this->m_LowerTimeBound ) / static_cast<RealType>(this->m_NumberOfIntegrationSteps);
+
+  // Quantize velocity unless a matching copy was set since the velocity was last modified
+  if( this->m_UseQuantizedVelocity )
+  {
+    if( this->m_QuantizedVelocityField.IsNull() ||
+        this->m_QuantizedVelocityField->GetBufferedRegion() != inputField->GetBufferedRegion() ||
+        this->m_QuantizedVelocityField->GetMTime() < inputField->GetMTime() )
+    {
+      typename QuantizedVelocityFieldType::Pointer quantizedVelocityField = QuantizedVelocityFieldType::New();
+      quantizedVelocityField->Quantize( inputField );
+      this->m_QuantizedVelocityField = quantizedVelocityField;
+    }
+  }
+
+  // Cached blocks may belong to a previous quantized velocity
+  this->m_QuantizedVelocityCaches.clear();
+
+  // Allocate log Jacobian determinant and sample div v alongside v
+  this->m_LogJacobianDeterminant = nullptr;
+  if( this->m_CalculateLogJacobianDeterminant )
+  {
+    const DisplacementFieldType * outputField = this->GetOutput();
+    this->m_LogJacobianDeterminant = ScalarFieldType::New();
+    this->m_LogJacobianDeterminant->CopyInformation( outputField );
+    this->m_LogJacobianDeterminant->SetRegions( outputField->GetLargestPossibleRegion() );
+    this->m_LogJacobianDeterminant->Allocate();
+
+    // Nothing is integrated when the time bounds are equal, so div v isn't needed
+    const bool isIdentity = Math::ExactlyEquals( this->m_LowerTimeBound, this->m_UpperTimeBound ) || this->m_NumberOfIntegrationSteps == 0;
+    if( !isIdentity )
+    {
+      // Compute div v unless a matching one was computed since v was last modified
+      if( this->m_VelocityDivergence.IsNull() ||
+          this->m_VelocityDivergence->GetBufferedRegion() != inputField->GetBufferedRegion() ||
+          this->m_VelocityDivergence->GetMTime() < inputField->GetMTime() )
+      {
+        this->m_VelocityDivergence = this->CalculateVelocityDivergence();
+      }
+      this->m_DivergenceInterpolator->SetInputImage( this->m_VelocityDivergence );
+      this->m_DivergenceExtrapolator->SetInputImage( this->m_VelocityDivergence );
+    }
+  }
 }
 
 template<typename TTimeVaryingVelocityField, typename TDisplacementField>
-void
+typename TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
+  <TTimeVaryingVelocityField, TDisplacementField>::TimeVaryingScalarFieldPointer
 TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
-<TTimeVaryingVelocityField, TDisplacementField>
-::ThreadedGenerateData( const OutputRegionType &region, ThreadIdType itkNotUsed( threadId ) )
+  <TTimeVaryingVelocityField, TDisplacementField>
+::CalculateVelocityDivergence()
 {
-  if( Math::ExactlyEquals( this->m_LowerTimeBound, this->m_UpperTimeBound ) )
+  const TimeVaryingVelocityFieldType * inputField = this->GetInput();
+
+  using RegionType = typename TimeVaryingVelocityFieldType::RegionType;
+  using IndexType = typename TimeVaryingVelocityFieldType::IndexType;
+  const RegionType region = inputField->GetBufferedRegion();
+
+  TimeVaryingScalarFieldPointer velocityDivergence = TimeVaryingScalarFieldType::New();
+  velocityDivergence->CopyInformation( inputField );
+  velocityDivergence->SetRegions( region );
+  velocityDivergence->Allocate();
+
+  IndexType firstIndex = region.GetIndex();
+  IndexType lastIndex = region.GetIndex();
+  for( unsigned k = 0; k < InputImageDimension; k++ ){ lastIndex[k] += ( region.GetSize()[k] - 1 ); }
+
+  // d/dx_m = \sum_k (D^{-1})_{km} / s_k d/di_k
+  const typename TimeVaryingVelocityFieldType::DirectionType inverseDirection = inputField->GetInverseDirection();
+  const typename TimeVaryingVelocityFieldType::SpacingType spacing = inputField->GetSpacing();
+  RealType weights[OutputImageDimension][OutputImageDimension];
+  for( unsigned int k = 0; k < OutputImageDimension; k++ )
   {
-    return;
+    for( unsigned int m = 0; m < OutputImageDimension; m++ ){ weights[k][m] = inverseDirection[k][m] / spacing[k]; }
   }
 
-  if( this->m_NumberOfIntegrationSteps == 0 )
+  // Neighbors are read from the buffer directly, wrapping at the boundary like the velocity extrapolator
+  const VectorType *    velocityBuffer = inputField->GetBufferPointer();
+  const OffsetValueType * offsetTable = inputField->GetOffsetTable();
+
+  this->GetMultiThreader()->template ParallelizeImageRegion<InputImageDimension>( region,
+    [&]( const RegionType & subregion )
+    {
+      ImageRegionIteratorWithIndex<TimeVaryingScalarFieldType> It( velocityDivergence, subregion );
+      for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+      {
+        const IndexType       index = It.GetIndex();
+        const OffsetValueType offset = inputField->ComputeOffset( index );
+        RealType divergence = 0;
+        for( unsigned int k = 0; k < OutputImageDimension; k++ )
+        {
+          const OffsetValueType wrap = static_cast<OffsetValueType>( region.GetSize()[k] - 1 ) * offsetTable[k];
+          const OffsetValueType forwardOffset = ( index[k] == lastIndex[k] ) ? -wrap : offsetTable[k];
+          const OffsetValueType backwardOffset = ( index[k] == firstIndex[k] ) ? wrap : -offsetTable[k];
+          const VectorType difference = ( velocityBuffer[offset + forwardOffset] - velocityBuffer[offset + backwardOffset] ) * 0.5; // dv/di_k
+
+          for( unsigned int m = 0; m < OutputImageDimension; m++ )
+          {
+            divergence += difference[m] * weights[k][m]; // dv_m/dx_m
+          }
+        }
+        It.Set( divergence ); // div v
+      }
+    }, nullptr );
+
+  return velocityDivergence;
+}
+
+template<typename TTimeVaryingVelocityField, typename TDisplacementField>
+void
+TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
+<TTimeVaryingVelocityField, TDisplacementField>
+::DynamicThreadedGenerateData( const OutputRegionType &region )
+{
+  typename DisplacementFieldType::Pointer outputField = this->GetOutput();
+
+  ImageRegionIteratorWithIndex<DisplacementFieldType> It( outputField, region );
+
+  // Map is the identity when there is nothing to integrate
+  if( Math::ExactlyEquals( this->m_LowerTimeBound, this->m_UpperTimeBound ) || this->m_NumberOfIntegrationSteps == 0 )
   {
+    for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    {
+      It.Set( NumericTraits<VectorType>::ZeroValue() );
+      if( this->m_LogJacobianDeterminant ){ this->m_LogJacobianDeterminant->SetPixel( It.GetIndex(), 0 ); }
+    }
     return;
   }
 
   const TimeVaryingVelocityFieldType * inputField = this->GetInput();
 
-  typename DisplacementFieldType::Pointer outputField = this->GetOutput();
-
-  ImageRegionIteratorWithIndex<DisplacementFieldType> It( outputField, region );
+  // Decoded velocity blocks are cached in a cache that no other work unit uses until this one is done
+  std::unique_ptr<QuantizedVelocityCacheType> velocityCache;
+  if( this->m_UseQuantizedVelocity )
+  {
+    velocityCache = this->AcquireQuantizedVelocityCache();
+  }
 
   for( It.GoToBegin(); !It.IsAtEnd(); ++It )
   {
     PointType point;
     outputField->TransformIndexToPhysicalPoint( It.GetIndex(), point );
-    VectorType displacement = this->IntegrateVelocityAtPoint( point, inputField );
-    It.Set( displacement );
+
+    if( this->m_LogJacobianDeterminant )
+    {
+      RealType logJacobianDeterminant = 0;
+      It.Set( this->IntegrateVelocityAtPoint( point, inputField, &logJacobianDeterminant, velocityCache.get() ) );
+      this->m_LogJacobianDeterminant->SetPixel( It.GetIndex(), logJacobianDeterminant );
+    }
+    else
+    {
+      It.Set( this->IntegrateVelocityAtPoint( point, inputField, nullptr, velocityCache.get() ) );
+    }
+  }
+
+  if( velocityCache )
+  {
+    this->ReleaseQuantizedVelocityCache( std::move( velocityCache ) );
+  }
+}
+
+template<typename TTimeVaryingVelocityField, typename TDisplacementField>
+std::unique_ptr<typename TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
+  <TTimeVaryingVelocityField, TDisplacementField>::QuantizedVelocityCacheType>
+TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
+  <TTimeVaryingVelocityField, TDisplacementField>
+::AcquireQuantizedVelocityCache()
+{
+  {
+    std::lock_guard<std::mutex> lock( this->m_QuantizedVelocityCacheMutex );
+    if( !this->m_QuantizedVelocityCaches.empty() )
+    {
+      std::unique_ptr<QuantizedVelocityCacheType> velocityCache = std::move( this->m_QuantizedVelocityCaches.back() );
+      this->m_QuantizedVelocityCaches.pop_back();
+      return velocityCache;
+    }
   }
 
+  // Pool is empty, so more work units are running than there are caches
+  return std::unique_ptr<QuantizedVelocityCacheType>( new QuantizedVelocityCacheType( this->m_QuantizedVelocityField.GetPointer() ) );
 }
 
+template<typename TTimeVaryingVelocityField, typename TDisplacementField>
+void
+TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
+<TTimeVaryingVelocityField, TDisplacementField>
+::ReleaseQuantizedVelocityCache( std::unique_ptr<QuantizedVelocityCacheType> velocityCache )
+{
+  std::lock_guard<std::mutex> lock( this->m_QuantizedVelocityCacheMutex );
+  this->m_QuantizedVelocityCaches.push_back( std::move( velocityCache ) );
+}
 
 template<typename TTimeVaryingVelocityField, typename TDisplacementField>
 typename TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
@@ -137,6 +300,94 @@ TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
   <TTimeVaryingVelocityField, TDisplacementField>
 ::IntegrateVelocityAtPoint( const PointType & initialSpatialPoint,
                             const TimeVaryingVelocityFieldType *inputField )
+{
+  return this->IntegrateVelocityAtPoint( initialSpatialPoint, inputField, nullptr, nullptr );
+}
+
+template<typename TTimeVaryingVelocityField, typename TDisplacementField>
+typename TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
+  <TTimeVaryingVelocityField, TDisplacementField>::VectorType
+TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
+  <TTimeVaryingVelocityField, TDisplacementField>
+::EvaluateQuantizedVelocity( const typename TimeVaryingVelocityFieldType::PointType & spaceTimePoint,
+                             const TimeVaryingVelocityFieldType *inputField,
+                             QuantizedVelocityCacheType & velocityCache ) const
+{
+  using RegionType = typename TimeVaryingVelocityFieldType::RegionType;
+  using IndexType = typename TimeVaryingVelocityFieldType::IndexType;
+  using IndexValueType = typename IndexType::IndexValueType;
+
+  const RegionType region = inputField->GetBufferedRegion();
+  const IndexType  startIndex = region.GetIndex();
+  IndexType        endIndex = region.GetIndex();
+  for( unsigned k = 0; k < InputImageDimension; k++ ){ endIndex[k] += ( region.GetSize()[k] - 1 ); }
+
+  ContinuousIndex<RealType, InputImageDimension> index;
+  inputField->TransformPhysicalPointToContinuousIndex( spaceTimePoint, index );
+
+  // Wrap points outside of buffer like the velocity extrapolator
+  bool isInside = true;
+  for( unsigned k = 0; k < InputImageDimension; k++ )
+  {
+    if( !( index[k] >= startIndex[k] - 0.5 && index[k] < endIndex[k] + 0.5 ) ){ isInside = false; }
+  }
+  if( !isInside )
+  {
+    for( unsigned k = 0; k < InputImageDimension; k++ )
+    {
+      while( index[k] > endIndex[k] ){ index[k] -= region.GetSize()[k]; }
+      while( index[k] < startIndex[k] ){ index[k] += region.GetSize()[k]; }
+    }
+  }
+
+  // Linearly interpolate neighbors, clamping them to the buffer like the velocity interpolator
+  IndexType baseIndex;
+  RealType  distance[InputImageDimension];
+  for( unsigned k = 0; k < InputImageDimension; k++ )
+  {
+    baseIndex[k] = Math::Floor<IndexValueType>( index[k] );
+    distance[k] = index[k] - baseIndex[k];
+  }
+
+  VectorType velocity;
+  velocity.Fill( 0 );
+  for( unsigned int corner = 0; corner < ( 1u << InputImageDimension ); corner++ )
+  {
+    RealType      weight = 1;
+    SizeValueType offset = 0;
+    SizeValueType stride = 1;
+    for( unsigned k = 0; k < InputImageDimension; k++ )
+    {
+      IndexValueType neighborIndex = baseIndex[k];
+      if( corner & ( 1u << k ) )
+      {
+        neighborIndex++;
+        weight *= distance[k];
+      }
+      else
+      {
+        weight *= 1.0 - distance[k];
+      }
+      neighborIndex = std::max( startIndex[k], std::min( endIndex[k], neighborIndex ) );
+      offset += ( neighborIndex - startIndex[k] ) * stride;
+      stride *= region.GetSize()[k];
+    }
+
+    if( weight > 0 ){ velocity += velocityCache.GetPixel( offset ) * weight; }
+  }
+
+  return velocity;
+}
+
+template<typename TTimeVaryingVelocityField, typename TDisplacementField>
+typename TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
+  <TTimeVaryingVelocityField, TDisplacementField>::VectorType
+TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
+  <TTimeVaryingVelocityField, TDisplacementField>
+::IntegrateVelocityAtPoint( const PointType & initialSpatialPoint,
+                            const TimeVaryingVelocityFieldType *inputField,
+                            RealType * logJacobianDeterminant,
+                            QuantizedVelocityCacheType * velocityCache )
 {
   // Set initial position
   PointType currentSpatialPoint = initialSpatialPoint;
@@ -156,17 +407,19 @@ TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
   {
     VectorType displacement; displacement.Fill(0);
     PointType  spatialPoint = currentSpatialPoint;
+    typename TimeVaryingVelocityFieldType::PointType spaceTimePoint;
     for(unsigned int i = 0; i < this->m_NumberOfIterations; i++)
     {
       displacement = displacement * 0.5; // Don't step too far!
       spatialPoint = currentSpatialPoint + displacement;
 
-      typename TimeVaryingVelocityFieldType::PointType spaceTimePoint;
       for(unsigned int k = 0; k < OutputImageDimension; k++){ spaceTimePoint[k] = spatialPoint[k]; }
       spaceTimePoint[OutputImageDimension] = m_TimeSpan*timePoint + m_TimeOrigin;
 
       VectorType velocity;
-      if(this->GetVelocityFieldInterpolator()->IsInsideBuffer(spaceTimePoint))
+      if(velocityCache)
+      { velocity = this->EvaluateQuantizedVelocity(spaceTimePoint, inputField, *velocityCache); }
+      else if(this->GetVelocityFieldInterpolator()->IsInsideBuffer(spaceTimePoint))
       { velocity = this->GetVelocityFieldInterpolator()->Evaluate(spaceTimePoint); }
       else
       { velocity = this->GetVelocityFieldExtrapolator()->Evaluate(spaceTimePoint); }
@@ -174,6 +427,18 @@ TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
       displacement = velocity*m_DeltaTime;
     }
     currentSpatialPoint += displacement;
+
+    // Accumulate d/dt log|D\phi| = div v at the same midpoint as the velocity
+    if( logJacobianDeterminant && this->m_NumberOfIterations > 0 )
+    {
+      RealType divergence;
+      if(this->m_DivergenceInterpolator->IsInsideBuffer(spaceTimePoint))
+      { divergence = this->m_DivergenceInterpolator->Evaluate(spaceTimePoint); }
+      else
+      { divergence = this->m_DivergenceExtrapolator->Evaluate(spaceTimePoint); }
+
+      *logJacobianDeterminant += divergence*m_DeltaTime;
+    }
   }
 
   return currentSpatialPoint.GetVectorFromOrigin() - initialSpatialPoint.GetVectorFromOrigin();
@@ -187,6 +452,8 @@ TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter<TTimeVaryingVelocit
   Superclass::PrintSelf(os, indent);
   os << indent << "VelocityFieldExtrapolator: " << this->m_VelocityFieldExtrapolator << std::endl;
   os << indent << "DisplacementFieldExtrapolator: " << this->m_DisplacementFieldExtrapolator << std::endl;
+  os << indent << "CalculateLogJacobianDeterminant: " << this->m_CalculateLogJacobianDeterminant << std::endl;
+  os << indent << "UseQuantizedVelocity: " << this->m_UseQuantizedVelocity << std::endl;
 }
 
 }  //end namespace itk
@@ -19,6 +19,7 @@
 #define itkTimeVaryingVelocityFieldSemiLagrangianTransform_h
 
 #include "itkTimeVaryingVelocityFieldTransform.h"
+#include "itkBlockQuantizedVectorField.h"
 
 namespace itk
 {
@@ -66,6 +67,16 @@ public:
   /** Scalar type. */
   using ScalarType = typename Superclass::ScalarType;
 
+  /** Log Jacobian determinant type. */
+  using ScalarFieldType = Image<ScalarType, NDimensions>;
+  using ScalarFieldPointer = typename ScalarFieldType::Pointer;
+  using TimeVaryingScalarFieldType = Image<ScalarType, NDimensions + 1>;
+  using TimeVaryingScalarFieldConstPointer = typename TimeVaryingScalarFieldType::ConstPointer;
+
+  /** Quantized velocity type. */
+  using QuantizedVelocityFieldType = BlockQuantizedVectorField<VelocityFieldType>;
+  using QuantizedVelocityFieldPointer = typename QuantizedVelocityFieldType::Pointer;
+
   /** Type of the input parameters. */
   using ParametersType = typename Superclass::ParametersType;
   using ParametersValueType = typename Superclass::ParametersValueType;
@@ -84,6 +95,20 @@ public:
   itkSetMacro(UseInverse, bool);
   itkGetConstMacro(UseInverse, bool);
 
+  /** Also transport log|D\phi| of the displacement field during integration.
+   * The divergence of the velocity is reused until the velocity field changes. */
+  itkBooleanMacro(CalculateLogJacobianDeterminant);
+  itkSetMacro(CalculateLogJacobianDeterminant, bool);
+  itkGetConstMacro(CalculateLogJacobianDeterminant, bool);
+  itkGetModifiableObjectMacro(LogJacobianDeterminant, ScalarFieldType);
+
+  /** Integrate a 16-bit block-quantized copy of the velocity.  The copy is
+   * reused until the velocity field changes. */
+  itkBooleanMacro(UseQuantizedVelocity);
+  itkSetMacro(UseQuantizedVelocity, bool);
+  itkGetConstMacro(UseQuantizedVelocity, bool);
+  itkGetConstObjectMacro(QuantizedVelocityField, QuantizedVelocityFieldType);
+
 protected:
   TimeVaryingVelocityFieldSemiLagrangianTransform();
   ~TimeVaryingVelocityFieldSemiLagrangianTransform() override = default;
@@ -91,6 +116,13 @@ protected:
 private:
 
   bool m_UseInverse;
+  bool m_CalculateLogJacobianDeterminant;
+  ScalarFieldPointer m_LogJacobianDeterminant;
+  TimeVaryingScalarFieldConstPointer m_VelocityDivergence;
+  const VelocityFieldType * m_VelocityDivergenceSource;
+  bool m_UseQuantizedVelocity;
+  QuantizedVelocityFieldPointer m_QuantizedVelocityField;
+  const VelocityFieldType * m_QuantizedVelocityFieldSource;
 };
 
 } // end namespace itk
@@ -30,6 +30,10 @@ TimeVaryingVelocityFieldSemiLagrangianTransform<TParametersValueType, NDimension
 ::TimeVaryingVelocityFieldSemiLagrangianTransform()
 {
   m_UseInverse = true;
+  m_CalculateLogJacobianDeterminant = false;
+  m_VelocityDivergenceSource = nullptr;
+  m_UseQuantizedVelocity = false;
+  m_QuantizedVelocityFieldSource = nullptr;
 }
 
 
@@ -43,6 +47,30 @@ TimeVaryingVelocityFieldSemiLagrangianTransform<TParametersValueType, NDimension
     using IntegratorType = TimeVaryingVelocityFieldSemiLagrangianIntegrationImageFilter
       <VelocityFieldType, DisplacementFieldType>;
 
+    // Quantize velocity unless it hasn't changed since it was last quantized
+    if( m_UseQuantizedVelocity )
+    {
+      if( m_QuantizedVelocityField.IsNull() || m_QuantizedVelocityFieldSource != this->GetVelocityField() ||
+          this->GetVelocityField()->GetMTime() > m_QuantizedVelocityField->GetMTime() )
+      {
+        m_QuantizedVelocityField = QuantizedVelocityFieldType::New();
+        m_QuantizedVelocityField->Quantize( this->GetVelocityField() );
+        m_QuantizedVelocityFieldSource = this->GetVelocityField();
+      }
+    }
+
+    // Reuse div v unless the velocity field has changed since it was computed
+    const bool calculateDivergence = m_CalculateLogJacobianDeterminant &&
+      !Math::ExactlyEquals( this->GetLowerTimeBound(), this->GetUpperTimeBound() );
+    if( calculateDivergence )
+    {
+      if( m_VelocityDivergence.IsNull() || m_VelocityDivergenceSource != this->GetVelocityField() ||
+          this->GetVelocityField()->GetMTime() > m_VelocityDivergence->GetMTime() )
+      {
+        m_VelocityDivergence = nullptr;
+      }
+    }
+
     typename IntegratorType::Pointer integrator = IntegratorType::New();
     integrator->SetInput( this->GetVelocityField() );
     integrator->SetLowerTimeBound( this->GetLowerTimeBound() );
@@ -54,10 +82,20 @@ TimeVaryingVelocityFieldSemiLagrangianTransform<TParametersValueType, NDimension
       }
 
     integrator->SetNumberOfIntegrationSteps( this->GetNumberOfIntegrationSteps() );
+    integrator->SetCalculateLogJacobianDeterminant( m_CalculateLogJacobianDeterminant );
+    if( calculateDivergence ){ integrator->SetVelocityDivergence( m_VelocityDivergence ); }
+    integrator->SetUseQuantizedVelocity( m_UseQuantizedVelocity );
+    integrator->SetQuantizedVelocityField( m_QuantizedVelocityField );
     integrator->Update();
 
     typename DisplacementFieldType::Pointer displacementField = integrator->GetOutput();
     displacementField->DisconnectPipeline();
+    m_LogJacobianDeterminant = integrator->GetLogJacobianDeterminant();
+    if( calculateDivergence )
+    {
+      m_VelocityDivergence = integrator->GetVelocityDivergence();
+      m_VelocityDivergenceSource = this->GetVelocityField();
+    }
 
     this->SetDisplacementField( displacementField );
     this->GetModifiableInterpolator()->SetInputImage( displacementField );
@@ -74,6 +112,8 @@ TimeVaryingVelocityFieldSemiLagrangianTransform<TParametersValueType, NDimension
       }
 
       inverseIntegrator->SetNumberOfIntegrationSteps( this->GetNumberOfIntegrationSteps() );
+      inverseIntegrator->SetUseQuantizedVelocity( m_UseQuantizedVelocity );
+      inverseIntegrator->SetQuantizedVelocityField( m_QuantizedVelocityField );
       inverseIntegrator->Update();
 
       typename DisplacementFieldType::Pointer inverseDisplacementField = inverseIntegrator->GetOutput();
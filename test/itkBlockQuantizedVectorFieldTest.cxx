@@ -0,0 +1,126 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkBlockQuantizedVectorField.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkTestingMacros.h"
+
+
+int itkBlockQuantizedVectorFieldTest( int argc, char * argv[] )
+{
+  if( argc < 2 )
+    {
+    std::cerr << "Missing parameters." << std::endl;
+    std::cerr << "Usage: " << argv[0];
+    std::cerr << " outputImage";
+    std::cerr << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  const unsigned int Dimension = 2;
+  using VectorType = itk::Vector< double, Dimension >;
+  using FieldType = itk::Image< VectorType, Dimension + 1 >;
+
+  using QuantizedFieldType = itk::BlockQuantizedVectorField< FieldType >;
+  QuantizedFieldType::Pointer quantizedField = QuantizedFieldType::New();
+
+  EXERCISE_BASIC_OBJECT_METHODS( quantizedField, BlockQuantizedVectorField, Object );
+
+  itk::SizeValueType blockLength = 16;
+  quantizedField->SetBlockLength( blockLength );
+  TEST_SET_GET_VALUE( blockLength, quantizedField->GetBlockLength() );
+
+  // Create a smooth field whose size is not a multiple of the block length
+  FieldType::SizeType size;
+  size[0] = 13; size[1] = 11; size[2] = 5;
+  FieldType::Pointer field = FieldType::New();
+  field->SetRegions( size );
+  field->Allocate();
+
+  itk::ImageRegionIteratorWithIndex< FieldType > it( field, field->GetBufferedRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    const FieldType::IndexType index = it.GetIndex();
+    VectorType v;
+    v[0] = std::sin( 0.5 * index[0] ) * ( 1.0 + index[2] );
+    v[1] = 0.01 * std::cos( 0.3 * index[1] + index[0] );
+    it.Set( v );
+    }
+
+  TRY_EXPECT_NO_EXCEPTION( quantizedField->Quantize( field ) );
+
+  const itk::SizeValueType numberOfPixels = field->GetBufferedRegion().GetNumberOfPixels();
+  TEST_EXPECT_EQUAL( quantizedField->GetNumberOfPixels(), numberOfPixels );
+  TEST_EXPECT_EQUAL( quantizedField->GetNumberOfBlocks(), ( numberOfPixels + blockLength - 1 ) / blockLength );
+  TEST_EXPECT_TRUE( quantizedField->GetNumberOfBytes() < numberOfPixels * sizeof( VectorType ) );
+
+  // Decode through a small cache so that entries are evicted
+  QuantizedFieldType::DecodeCache cache( quantizedField, 3 );
+  double maximumError = 0;
+  for( itk::SizeValueType offset = 0; offset < numberOfPixels; ++offset )
+    {
+    const VectorType & decoded = cache.GetPixel( ( offset * 7 ) % numberOfPixels );
+    const VectorType & value = field->GetBufferPointer()[( offset * 7 ) % numberOfPixels];
+    for( unsigned int i = 0; i < Dimension; ++i )
+      {
+      maximumError = std::max( maximumError, std::abs( decoded[i] - value[i] ) );
+      }
+    }
+
+  if( maximumError > quantizedField->GetMaximumAbsoluteError() + 1e-12 )
+    {
+    std::cerr << "Test failed!" << std::endl;
+    std::cerr << "Decoded error " << maximumError << " exceeds reported error "
+              << quantizedField->GetMaximumAbsoluteError() << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // Decoding the whole field should match the cache
+  FieldType::Pointer decodedField = FieldType::New();
+  decodedField->SetRegions( size );
+  decodedField->Allocate();
+  TRY_EXPECT_NO_EXCEPTION( quantizedField->Decode( decodedField ) );
+
+  QuantizedFieldType::DecodeCache fieldCache( quantizedField );
+  for( itk::SizeValueType offset = 0; offset < numberOfPixels; ++offset )
+    {
+    if( decodedField->GetBufferPointer()[offset] != fieldCache.GetPixel( offset ) )
+      {
+      std::cerr << "Test failed!" << std::endl;
+      std::cerr << "Decoded field differs from the cache at offset " << offset << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  FieldType::SizeType smallerSize = size;
+  smallerSize[2] = 4;
+  FieldType::Pointer smallerField = FieldType::New();
+  smallerField->SetRegions( smallerSize );
+  smallerField->Allocate();
+  TRY_EXPECT_EXCEPTION( quantizedField->Decode( smallerField ) );
+
+  if( quantizedField->GetRelativeError() > 1e-3 )
+    {
+    std::cerr << "Test failed!" << std::endl;
+    std::cerr << "Relative error " << quantizedField->GetRelativeError() << " is too large" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test finished." << std::endl;
+  return EXIT_SUCCESS;
+}
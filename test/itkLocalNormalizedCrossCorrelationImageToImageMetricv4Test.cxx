@@ -0,0 +1,142 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         https://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkLocalNormalizedCrossCorrelationImageToImageMetricv4.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkDisplacementFieldTransform.h"
+#include "itkTestingMacros.h"
+
+
+int itkLocalNormalizedCrossCorrelationImageToImageMetricv4Test( int argc, char * argv[] )
+{
+  if( argc < 2 )
+    {
+    std::cerr << "Missing parameters." << std::endl;
+    std::cerr << "Usage: " << argv[0];
+    std::cerr << " outputImage";
+    std::cerr << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  const unsigned int Dimension = 2;
+  using PixelType = float;
+  using ImageType = itk::Image< PixelType, Dimension >;
+
+  using MetricType = itk::LocalNormalizedCrossCorrelationImageToImageMetricv4< ImageType, ImageType >;
+  MetricType::Pointer metric = MetricType::New();
+
+  EXERCISE_BASIC_OBJECT_METHODS( metric, LocalNormalizedCrossCorrelationImageToImageMetricv4,
+    ImageToImageMetricv4 );
+
+  MetricType::RadiusType radius;
+  radius.Fill( 3 );
+  metric->SetRadius( radius );
+  TEST_SET_GET_VALUE( radius, metric->GetRadius() );
+
+  // Identical images should be perfectly correlated
+  ImageType::SizeType size;
+  size.Fill( 16 );
+  ImageType::Pointer image = ImageType::New();
+  image->SetRegions( size );
+  image->Allocate();
+
+  itk::ImageRegionIteratorWithIndex< ImageType > it( image, image->GetLargestPossibleRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    const ImageType::IndexType index = it.GetIndex();
+    it.Set( std::sin( 0.7 * index[0] ) + std::cos( 0.5 * index[1] ) + 0.1 * index[0] * index[1] );
+    }
+
+  metric->SetFixedImage( image );
+  metric->SetMovingImage( image );
+  TRY_EXPECT_NO_EXCEPTION( metric->Initialize() );
+
+  const MetricType::MeasureType value = metric->GetValue();
+  std::cout << "Value: " << value << std::endl;
+  if( std::abs( value + 1.0 ) > 1e-6 )
+    {
+    std::cerr << "Test failed!" << std::endl;
+    std::cerr << "Expected value -1 for identical images, but got " << value << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // Derivative should match central differences of the value under a displacement of one voxel
+  ImageType::Pointer movingImage = ImageType::New();
+  movingImage->SetRegions( size );
+  movingImage->Allocate();
+
+  itk::ImageRegionIteratorWithIndex< ImageType > movingIt( movingImage, movingImage->GetLargestPossibleRegion() );
+  for( movingIt.GoToBegin(); !movingIt.IsAtEnd(); ++movingIt )
+    {
+    const ImageType::IndexType index = movingIt.GetIndex();
+    movingIt.Set( std::sin( 0.7 * index[0] - 0.4 ) + 0.8 * std::cos( 0.5 * index[1] ) + 0.08 * index[0] * index[1] );
+    }
+
+  using TransformType = itk::DisplacementFieldTransform< double, Dimension >;
+  TransformType::DisplacementFieldType::Pointer field = TransformType::DisplacementFieldType::New();
+  field->SetRegions( size );
+  field->Allocate();
+  field->FillBuffer( TransformType::DisplacementFieldType::PixelType( 0.0 ) );
+
+  TransformType::Pointer transform = TransformType::New();
+  transform->SetDisplacementField( field );
+
+  metric->SetMovingImage( movingImage );
+  metric->SetMovingTransform( transform );
+  metric->SetUseMovingImageGradientFilter( false );
+  TRY_EXPECT_NO_EXCEPTION( metric->Initialize() );
+
+  MetricType::MeasureType    derivativeValue;
+  MetricType::DerivativeType derivative;
+  metric->GetValueAndDerivative( derivativeValue, derivative );
+  const double numberOfValidPoints = metric->GetNumberOfValidPoints();
+
+  const double step = 1e-3;
+  double * displacement = field->GetBufferPointer()->GetDataPointer();
+  const itk::IndexValueType checkIndices[3][Dimension] = { { 5, 7 }, { 8, 8 }, { 10, 4 } };
+  for( const auto & checkIndex : checkIndices )
+    {
+    const itk::OffsetValueType offset = checkIndex[0] + checkIndex[1] * size[0];
+    for( unsigned int i = 0; i < Dimension; i++ )
+      {
+      const itk::OffsetValueType parameter = offset * Dimension + i;
+      displacement[parameter] = step;
+      field->Modified();
+      const double forwardValue = metric->GetValue();
+      displacement[parameter] = -step;
+      field->Modified();
+      const double backwardValue = metric->GetValue();
+      displacement[parameter] = 0;
+      field->Modified();
+
+      // Derivative is -N dV/du
+      const double expected = -numberOfValidPoints * ( forwardValue - backwardValue ) / ( 2 * step );
+      const double tolerance = 1e-3 * std::max( 1.0, std::abs( expected ) );
+      if( std::abs( derivative[parameter] - expected ) > tolerance )
+        {
+        std::cerr << "Test failed!" << std::endl;
+        std::cerr << "Derivative at [" << checkIndex[0] << ", " << checkIndex[1] << "] component " << i
+          << " is " << derivative[parameter] << " but central difference gives " << expected << std::endl;
+        return EXIT_FAILURE;
+        }
+      }
+    }
+
+  std::cout << "Test finished." << std::endl;
+  return EXIT_SUCCESS;
+}
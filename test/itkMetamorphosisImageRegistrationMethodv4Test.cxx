@@ -20,6 +20,97 @@
 #include "itkImageFileWriter.h"
 #include "itkTestingMacros.h"
 
+namespace
+{
+// Exposes protected members of the registration method for testing
+template< typename TImage >
+class MetamorphosisImageRegistrationMethodv4TestHelper:
+  public itk::MetamorphosisImageRegistrationMethodv4< TImage, TImage >
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN(MetamorphosisImageRegistrationMethodv4TestHelper);
+
+  using Self = MetamorphosisImageRegistrationMethodv4TestHelper;
+  using Superclass = itk::MetamorphosisImageRegistrationMethodv4< TImage, TImage >;
+  using Pointer = itk::SmartPointer< Self >;
+
+  itkNewMacro( Self );
+  itkTypeMacro( MetamorphosisImageRegistrationMethodv4TestHelper, MetamorphosisImageRegistrationMethodv4 );
+
+  using OutputTransformType = typename Superclass::OutputTransformType;
+
+  using Superclass::Initialize;
+  using Superclass::StartOptimization;
+  using Superclass::InitializeKernels;
+  using Superclass::ProjectOntoVelocityBand;
+  using Superclass::SynthesizeFromVelocityBand;
+  using Superclass::CalculateNorm;
+  using Superclass::CalculateSliceSumsOfSquares;
+  using Superclass::UpdateControls;
+
+  OutputTransformType * GetVelocityTransform()
+    {
+    return this->m_OutputTransform.GetPointer();
+    }
+
+  typename Superclass::VirtualImageType * GetForwardImage()
+    {
+    return this->m_ForwardImage.GetPointer();
+    }
+
+  typename Superclass::MaskImageType * GetForwardMaskImage()
+    {
+    return this->m_ForwardMaskImage.GetPointer();
+    }
+
+  typename Superclass::BiasImageType * GetBiasImage()
+    {
+    return this->m_Bias.GetPointer();
+    }
+
+protected:
+  MetamorphosisImageRegistrationMethodv4TestHelper() = default;
+  ~MetamorphosisImageRegistrationMethodv4TestHelper() override = default;
+};
+
+// Creates an image of a Gaussian blob centered at center
+template< typename TImage >
+typename TImage::Pointer
+CreateBlobImage( const typename TImage::SizeType & size, const double center[] )
+{
+  typename TImage::Pointer image = TImage::New();
+  image->SetRegions( size );
+  image->Allocate();
+
+  itk::ImageRegionIteratorWithIndex< TImage > it( image, image->GetLargestPossibleRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    double squaredDistance = 0;
+    for( unsigned int i = 0; i < TImage::ImageDimension; i++ )
+      {
+      squaredDistance += std::pow( it.GetIndex()[i] - center[i], 2 );
+      }
+    it.Set( 100 * std::exp( -squaredDistance / 18.0 ) );
+    }
+
+  return image;
+}
+
+// Copies the pixels of an image so that they can be compared after it is replaced
+template< typename TImage >
+std::vector< typename TImage::PixelType >
+CopyPixels( const TImage * image )
+{
+  std::vector< typename TImage::PixelType > pixels;
+  itk::ImageRegionConstIterator< TImage > it( image, image->GetLargestPossibleRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    pixels.push_back( it.Get() );
+    }
+  return pixels;
+}
+} // end anonymous namespace
+
 
 int itkMetamorphosisImageRegistrationMethodv4Test( int argc, char * argv[] )
 {
@@ -46,6 +137,312 @@ int itkMetamorphosisImageRegistrationMethodv4Test( int argc, char * argv[] )
   EXERCISE_BASIC_OBJECT_METHODS( metamorphosisImageRegistration, MetamorphosisImageRegistrationMethodv4,
     TimeVaryingVelocityFieldImageRegistrationMethodv4 );
 
+  bool useBandLimitedVelocity = true;
+  TEST_SET_GET_BOOLEAN( metamorphosisImageRegistration, UseBandLimitedVelocity, useBandLimitedVelocity );
+
+  double velocityBandFraction = 0.5;
+  metamorphosisImageRegistration->SetVelocityBandFraction( velocityBandFraction );
+  TEST_SET_GET_VALUE( velocityBandFraction, metamorphosisImageRegistration->GetVelocityBandFraction() );
+
+  bool useGeodesicShooting = true;
+  TEST_SET_GET_BOOLEAN( metamorphosisImageRegistration, UseGeodesicShooting, useGeodesicShooting );
+
+  double maximumElapsedTime = 60.0;
+  metamorphosisImageRegistration->SetMaximumElapsedTime( maximumElapsedTime );
+  TEST_SET_GET_VALUE( maximumElapsedTime, metamorphosisImageRegistration->GetMaximumElapsedTime() );
+
+  bool useFFTSizeAutotuning = true;
+  TEST_SET_GET_BOOLEAN( metamorphosisImageRegistration, UseFFTSizeAutotuning, useFFTSizeAutotuning );
+
+  double maximumPaddingFraction = 0.5;
+  metamorphosisImageRegistration->SetMaximumPaddingFraction( maximumPaddingFraction );
+  TEST_SET_GET_VALUE( maximumPaddingFraction, metamorphosisImageRegistration->GetMaximumPaddingFraction() );
+
+  bool useQuantizedVelocity = true;
+  TEST_SET_GET_BOOLEAN( metamorphosisImageRegistration, UseQuantizedVelocity, useQuantizedVelocity );
+
+  // Create a pair of shifted blobs
+  ImageType::SizeType imageSize;
+  imageSize.Fill( 16 );
+  const double fixedCenter[Dimension] = { 8.0, 8.0 };
+  const double movingCenter[Dimension] = { 6.5, 8.0 };
+  ImageType::Pointer fixedImage = CreateBlobImage< ImageType >( imageSize, fixedCenter );
+  ImageType::Pointer movingImage = CreateBlobImage< ImageType >( imageSize, movingCenter );
+
+  using HelperType = MetamorphosisImageRegistrationMethodv4TestHelper< ImageType >;
+  using TimeVaryingFieldType = HelperType::TimeVaryingFieldType;
+  using TimeVaryingImageType = HelperType::TimeVaryingImageType;
+
+  // Geodesic shooting can't be combined with a band-limited velocity
+  HelperType::Pointer bandHelper = HelperType::New();
+  bandHelper->SetFixedImage( fixedImage );
+  bandHelper->SetMovingImage( movingImage );
+  bandHelper->SetNumberOfTimeSteps( 4 );
+  bandHelper->UseBandLimitedVelocityOn();
+  bandHelper->UseGeodesicShootingOn();
+  TRY_EXPECT_EXCEPTION( bandHelper->Initialize() );
+  TEST_EXPECT_TRUE( bandHelper->GetUseBandLimitedVelocity() );
+
+  bandHelper->UseGeodesicShootingOff();
+  bandHelper->SetVelocityBandFraction( 0.5 );
+  TRY_EXPECT_NO_EXCEPTION( bandHelper->Initialize() );
+
+  // Synthesize a band-limited velocity from an arbitrary one
+  TimeVaryingFieldType::Pointer velocity = TimeVaryingFieldType::New();
+  velocity->CopyInformation( bandHelper->GetVelocityTransform()->GetVelocityField() );
+  velocity->SetRegions( bandHelper->GetVelocityTransform()->GetVelocityField()->GetLargestPossibleRegion() );
+  velocity->Allocate();
+
+  itk::ImageRegionIteratorWithIndex< TimeVaryingFieldType > velocityIt( velocity, velocity->GetLargestPossibleRegion() );
+  for( velocityIt.GoToBegin(); !velocityIt.IsAtEnd(); ++velocityIt )
+    {
+    const TimeVaryingFieldType::IndexType index = velocityIt.GetIndex();
+    TimeVaryingFieldType::PixelType v;
+    v[0] = ( ( index[0] * 7 + index[1] * 3 + index[2] * 5 ) % 11 ) / 11.0 - 0.5;
+    v[1] = std::sin( 0.9 * index[0] ) * std::cos( 1.7 * index[1] + index[2] );
+    velocityIt.Set( v );
+    }
+
+  TimeVaryingFieldType::Pointer bandLimitedVelocity =
+    bandHelper->SynthesizeFromVelocityBand( bandHelper->ProjectOntoVelocityBand( velocity ) );
+
+  // Projecting and synthesizing a band-limited velocity should reproduce it
+  TimeVaryingFieldType::Pointer reprojectedVelocity =
+    bandHelper->SynthesizeFromVelocityBand( bandHelper->ProjectOntoVelocityBand( bandLimitedVelocity ) );
+
+  double maximumVelocity = 0;
+  double maximumReprojectionError = 0;
+  itk::ImageRegionConstIterator< TimeVaryingFieldType > bandLimitedIt( bandLimitedVelocity, bandLimitedVelocity->GetLargestPossibleRegion() );
+  itk::ImageRegionConstIterator< TimeVaryingFieldType > reprojectedIt( reprojectedVelocity, reprojectedVelocity->GetLargestPossibleRegion() );
+  for( bandLimitedIt.GoToBegin(), reprojectedIt.GoToBegin(); !bandLimitedIt.IsAtEnd(); ++bandLimitedIt, ++reprojectedIt )
+    {
+    maximumVelocity = std::max( maximumVelocity, bandLimitedIt.Get().GetNorm() );
+    maximumReprojectionError = std::max( maximumReprojectionError, ( reprojectedIt.Get() - bandLimitedIt.Get() ).GetNorm() );
+    }
+
+  std::cout << "Maximum band reprojection error: " << maximumReprojectionError << std::endl;
+  if( maximumVelocity < 1e-2 || maximumReprojectionError > 1e-4 * maximumVelocity )
+    {
+    std::cerr << "Test failed!" << std::endl;
+    std::cerr << "SynthesizeFromVelocityBand(ProjectOntoVelocityBand(v)) doesn't reproduce a band-limited v." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // Parseval energy of the band should equal the dense velocity energy, 0.5 ||L_V v||^2
+  TimeVaryingImageType::Pointer velocityKernel = TimeVaryingImageType::New();
+  TimeVaryingImageType::Pointer inverseVelocityKernel = TimeVaryingImageType::New();
+  bandHelper->InitializeKernels( velocityKernel, inverseVelocityKernel, bandHelper->GetRegistrationSmoothness(),
+    bandHelper->GetGamma() );
+  const double bandVelocityEnergy =
+    0.5 * std::pow( bandHelper->CalculateNorm( bandHelper->ProjectOntoVelocityBand( bandLimitedVelocity ), inverseVelocityKernel ), 2 );
+
+  bandHelper->UseBandLimitedVelocityOff();
+  bandHelper->GetVelocityTransform()->SetVelocityField( bandLimitedVelocity );
+  const double denseVelocityEnergy = bandHelper->GetVelocityEnergy();
+
+  std::cout << "Band velocity energy: " << bandVelocityEnergy << std::endl;
+  std::cout << "Dense velocity energy: " << denseVelocityEnergy << std::endl;
+  if( std::abs( bandVelocityEnergy - denseVelocityEnergy ) > 1e-3 * denseVelocityEnergy )
+    {
+    std::cerr << "Test failed!" << std::endl;
+    std::cerr << "Parseval energy of the velocity band doesn't match the dense velocity energy." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // Per-slice sums of squares should match a direct sum on a field with a large mean
+  TimeVaryingFieldType::SizeType largeFieldSize;
+  largeFieldSize[0] = 150;
+  largeFieldSize[1] = 130;
+  largeFieldSize[2] = 3;
+  TimeVaryingFieldType::Pointer largeField = TimeVaryingFieldType::New();
+  largeField->SetRegions( largeFieldSize );
+  largeField->Allocate();
+
+  std::vector< long double > directSliceSums( largeFieldSize[2], 0 );
+  itk::ImageRegionIteratorWithIndex< TimeVaryingFieldType > largeFieldIt( largeField, largeField->GetLargestPossibleRegion() );
+  for( largeFieldIt.GoToBegin(); !largeFieldIt.IsAtEnd(); ++largeFieldIt )
+    {
+    const TimeVaryingFieldType::IndexType index = largeFieldIt.GetIndex();
+    TimeVaryingFieldType::PixelType v;
+    v[0] = 1e4 + std::sin( 0.3 * index[0] + index[2] );
+    v[1] = -1e4 + std::cos( 0.2 * index[1] ) * index[2];
+    largeFieldIt.Set( v );
+    for( unsigned int i = 0; i < Dimension; i++ )
+      {
+      directSliceSums[index[2]] += static_cast< long double >( v[i] ) * v[i];
+      }
+    }
+
+  const std::vector< double > sliceSums = bandHelper->CalculateSliceSumsOfSquares( largeField.GetPointer() );
+  if( sliceSums.size() != directSliceSums.size() )
+    {
+    std::cerr << "Test failed!" << std::endl;
+    std::cerr << "Expected " << directSliceSums.size() << " slice sums, but got " << sliceSums.size() << std::endl;
+    return EXIT_FAILURE;
+    }
+  for( unsigned int j = 0; j < sliceSums.size(); j++ )
+    {
+    const long double relativeError = std::abs( sliceSums[j] - directSliceSums[j] ) / directSliceSums[j];
+    if( relativeError > 1e-12 )
+      {
+      std::cerr << "Test failed!" << std::endl;
+      std::cerr << "Sum of squares of slice " << j << " has relative error " << relativeError << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  // Geodesic shooting should decrease the energy
+  HelperType::Pointer shootingHelper = HelperType::New();
+  shootingHelper->SetFixedImage( fixedImage );
+  shootingHelper->SetMovingImage( movingImage );
+  shootingHelper->SetNumberOfTimeSteps( 4 );
+  shootingHelper->SetNumberOfIterations( 5 );
+  shootingHelper->UseGeodesicShootingOn();
+  shootingHelper->UseBiasOn();
+  TRY_EXPECT_NO_EXCEPTION( shootingHelper->Initialize() );
+  TEST_EXPECT_TRUE( !shootingHelper->GetUseBias() ); // Shooting doesn't generate a bias
+  const double initialEnergy = shootingHelper->GetEnergy();
+  TRY_EXPECT_NO_EXCEPTION( shootingHelper->StartOptimization() );
+  const double finalEnergy = shootingHelper->GetEnergy();
+
+  std::cout << "Shooting energy: " << initialEnergy << " -> " << finalEnergy << std::endl;
+  if( !( finalEnergy < initialEnergy ) )
+    {
+    std::cerr << "Test failed!" << std::endl;
+    std::cerr << "Geodesic shooting didn't decrease the energy." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // A rejected step should restore the accepted I(1), M(1), B(1), \phi_{10} and energy
+  using MaskImageType = HelperType::MaskImageType;
+  MaskImageType::Pointer maskImage = MaskImageType::New();
+  maskImage->SetRegions( imageSize );
+  maskImage->Allocate();
+
+  itk::ImageRegionIteratorWithIndex< MaskImageType > maskIt( maskImage, maskImage->GetLargestPossibleRegion() );
+  for( maskIt.GoToBegin(); !maskIt.IsAtEnd(); ++maskIt )
+    {
+    const MaskImageType::IndexType index = maskIt.GetIndex();
+    maskIt.Set( index[0] >= 2 && index[0] < 14 && index[1] >= 2 && index[1] < 14 );
+    }
+
+  HelperType::MaskType::Pointer movingMask = HelperType::MaskType::New();
+  movingMask->SetImage( maskImage );
+  movingMask->Update();
+
+  HelperType::Pointer restoreHelper = HelperType::New();
+  restoreHelper->SetFixedImage( fixedImage );
+  restoreHelper->SetMovingImage( movingImage );
+  restoreHelper->SetNumberOfTimeSteps( 4 );
+  restoreHelper->SetNumberOfIterations( 2 );
+  restoreHelper->UseBiasOn();
+  dynamic_cast< HelperType::ImageMetricType * >( restoreHelper->GetModifiableMetric() )->SetMovingImageMask( movingMask );
+  TRY_EXPECT_NO_EXCEPTION( restoreHelper->Initialize() );
+  TRY_EXPECT_NO_EXCEPTION( restoreHelper->StartOptimization() );
+
+  const auto acceptedForwardImage = CopyPixels( restoreHelper->GetForwardImage() );
+  const auto acceptedForwardMaskImage = CopyPixels( restoreHelper->GetForwardMaskImage() );
+  const auto acceptedBias = CopyPixels( restoreHelper->GetBiasImage() );
+  const auto acceptedDisplacementField = CopyPixels( restoreHelper->GetVelocityTransform()->GetDisplacementField() );
+  const double acceptedEnergy = restoreHelper->GetEnergy();
+  const double acceptedImageEnergy = restoreHelper->GetImageEnergy();
+
+  double maximumDisplacement = 0;
+  for( const auto & displacement : acceptedDisplacementField )
+    {
+    maximumDisplacement = std::max( maximumDisplacement, displacement.GetNorm() );
+    }
+
+  // A huge learning rate is rejected, and halving it falls below the minimum so no other step is tried
+  restoreHelper->SetLearningRate( 1e8 );
+  restoreHelper->SetMinLearningRate( 0.75e8 );
+  TRY_EXPECT_NO_EXCEPTION( restoreHelper->UpdateControls() );
+
+  std::cout << "Accepted energy: " << acceptedEnergy << ", restored energy: " << restoreHelper->GetEnergy() << std::endl;
+  if( maximumDisplacement < 1e-3 ||
+    CopyPixels( restoreHelper->GetForwardImage() ) != acceptedForwardImage ||
+    CopyPixels( restoreHelper->GetForwardMaskImage() ) != acceptedForwardMaskImage ||
+    CopyPixels( restoreHelper->GetBiasImage() ) != acceptedBias ||
+    CopyPixels( restoreHelper->GetVelocityTransform()->GetDisplacementField() ) != acceptedDisplacementField ||
+    restoreHelper->GetEnergy() != acceptedEnergy ||
+    std::abs( restoreHelper->GetImageEnergy() - acceptedImageEnergy ) > 1e-12 * acceptedImageEnergy )
+    {
+    std::cerr << "Test failed!" << std::endl;
+    std::cerr << "A rejected step didn't restore the accepted state." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // The restored \phi_{10} must match one integrated afresh from the restored velocity,
+  // so integrating the rate mustn't have replaced it
+  using OutputTransformType = HelperType::OutputTransformType;
+  OutputTransformType::Pointer freshTransform = OutputTransformType::New();
+  freshTransform->UseInverseOff();
+  freshTransform->SetVelocityField( restoreHelper->GetVelocityTransform()->GetVelocityField() );
+  freshTransform->SetNumberOfIntegrationSteps( restoreHelper->GetNumberOfTimeSteps() + 1 );
+  freshTransform->SetLowerTimeBound( 1.0 );
+  freshTransform->SetUpperTimeBound( 0.0 );
+  freshTransform->IntegrateVelocityField();
+
+  const auto freshDisplacementField = CopyPixels( freshTransform->GetDisplacementField() );
+  double maximumDisplacementError = 0;
+  for( std::size_t k = 0; k < freshDisplacementField.size(); k++ )
+    {
+    maximumDisplacementError = std::max( maximumDisplacementError, ( freshDisplacementField[k] - acceptedDisplacementField[k] ).GetNorm() );
+    }
+
+  std::cout << "Maximum restored displacement error: " << maximumDisplacementError << std::endl;
+  if( maximumDisplacementError > 1e-6 * std::max( maximumDisplacement, 1.0 ) )
+    {
+    std::cerr << "Test failed!" << std::endl;
+    std::cerr << "The restored displacement field doesn't match the restored velocity." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // A stop requested before Update() ends the run before the first iteration
+  MetamorphosisImageRegistrationMethodv4Type::Pointer stopRegistration = MetamorphosisImageRegistrationMethodv4Type::New();
+  stopRegistration->SetFixedImage( fixedImage );
+  stopRegistration->SetMovingImage( movingImage );
+  stopRegistration->SetNumberOfTimeSteps( 4 );
+  stopRegistration->SetNumberOfIterations( 5 );
+  stopRegistration->StopOptimization();
+  TRY_EXPECT_NO_EXCEPTION( stopRegistration->Update() );
+  std::cout << "Stop before update: " << stopRegistration->GetStopConditionDescription() << std::endl;
+  if( stopRegistration->GetStopConditionDescription() != "Optimization stopped by request" ||
+    stopRegistration->GetCurrentIteration() != 0 )
+    {
+    std::cerr << "Test failed!" << std::endl;
+    std::cerr << "A stop requested before Update() was ignored." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // The request was cleared when the run ended, so a stop from an observer ends the next run after one iteration
+  stopRegistration->AddObserver( itk::IterationEvent(),
+    [&stopRegistration]( const itk::EventObject & ) { stopRegistration->StopOptimization(); } );
+  stopRegistration->Modified();
+  TRY_EXPECT_NO_EXCEPTION( stopRegistration->Update() );
+  std::cout << "Stop from observer: " << stopRegistration->GetStopConditionDescription() << std::endl;
+  if( stopRegistration->GetStopConditionDescription() != "Optimization stopped by request" ||
+    stopRegistration->GetCurrentIteration() != 1 )
+    {
+    std::cerr << "Test failed!" << std::endl;
+    std::cerr << "A stop requested from an observer didn't end the run after one iteration." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // A time budget shorter than initialization ends the run before the first iteration
+  stopRegistration->RemoveAllObservers();
+  stopRegistration->SetMaximumElapsedTime( 1e-9 );
+  TRY_EXPECT_NO_EXCEPTION( stopRegistration->Update() );
+  std::cout << "Time budget: " << stopRegistration->GetStopConditionDescription() << ", elapsed time: "
+    << stopRegistration->GetElapsedTime() << std::endl;
+  if( stopRegistration->GetStopConditionDescription() != "Maximum elapsed time exceeded" ||
+    stopRegistration->GetCurrentIteration() != 0 ||
+    !( stopRegistration->GetElapsedTime() > 1e-9 ) )
+    {
+    std::cerr << "Test failed!" << std::endl;
+    std::cerr << "The time budget wasn't enforced." << std::endl;
+    return EXIT_FAILURE;
+    }
 
   std::cout << "Test finished." << std::endl;
   return EXIT_SUCCESS;
@@ -18,6 +18,8 @@
 
 #include "itkTimeVaryingVelocityFieldSemiLagrangianTransform.h"
 #include "itkImageFileWriter.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkDisplacementFieldJacobianDeterminantFilter.h"
 #include "itkTestingMacros.h"
 
 
@@ -44,6 +46,125 @@ int itkTimeVaryingVelocityFieldSemiLagrangianTransformTest( int argc, char * arg
   EXERCISE_BASIC_OBJECT_METHODS( timeVaryingVelocityFieldSemiLagrangianTransform,
     TimeVaryingVelocityFieldSemiLagrangianTransform, TimeVaryingVelocityFieldTransform );
 
+  bool calculateLogJacobianDeterminant = true;
+  TEST_SET_GET_BOOLEAN( timeVaryingVelocityFieldSemiLagrangianTransform, CalculateLogJacobianDeterminant,
+    calculateLogJacobianDeterminant );
+
+  // Create a smooth, periodic velocity with non-zero divergence
+  using VelocityFieldType = TimeVaryingVelocityFieldSemiLagrangianTransformType::VelocityFieldType;
+  using VectorType = VelocityFieldType::PixelType;
+  using DisplacementFieldType = TimeVaryingVelocityFieldSemiLagrangianTransformType::DisplacementFieldType;
+  using ScalarFieldType = TimeVaryingVelocityFieldSemiLagrangianTransformType::ScalarFieldType;
+
+  const double size = 32;
+  const double amplitude = 0.5;
+  VelocityFieldType::SizeType velocitySize;
+  velocitySize[0] = 32; velocitySize[1] = 32; velocitySize[2] = 5;
+  VelocityFieldType::Pointer velocity = VelocityFieldType::New();
+  velocity->SetRegions( velocitySize );
+  velocity->Allocate();
+
+  itk::ImageRegionIteratorWithIndex< VelocityFieldType > velocityIt( velocity, velocity->GetLargestPossibleRegion() );
+  for( velocityIt.GoToBegin(); !velocityIt.IsAtEnd(); ++velocityIt )
+    {
+    const VelocityFieldType::IndexType index = velocityIt.GetIndex();
+    VectorType v;
+    v[0] = amplitude * std::sin( 2 * itk::Math::pi * index[0] / size );
+    v[1] = amplitude * std::sin( 2 * itk::Math::pi * index[1] / size + 1.0 );
+    velocityIt.Set( v );
+    }
+
+  timeVaryingVelocityFieldSemiLagrangianTransform->UseInverseOff();
+  timeVaryingVelocityFieldSemiLagrangianTransform->SetVelocityField( velocity );
+  timeVaryingVelocityFieldSemiLagrangianTransform->SetNumberOfIntegrationSteps( 20 );
+  timeVaryingVelocityFieldSemiLagrangianTransform->SetLowerTimeBound( 0.0 );
+  timeVaryingVelocityFieldSemiLagrangianTransform->SetUpperTimeBound( 1.0 );
+  timeVaryingVelocityFieldSemiLagrangianTransform->CalculateLogJacobianDeterminantOn();
+  TRY_EXPECT_NO_EXCEPTION( timeVaryingVelocityFieldSemiLagrangianTransform->IntegrateVelocityField() );
+
+  // The transported log|D\phi| should agree with finite differences of \phi away from the boundary
+  using JacobianDeterminantFilterType = itk::DisplacementFieldJacobianDeterminantFilter< DisplacementFieldType, double, ScalarFieldType >;
+  JacobianDeterminantFilterType::Pointer jacobianDeterminantFilter = JacobianDeterminantFilterType::New();
+  jacobianDeterminantFilter->SetInput( timeVaryingVelocityFieldSemiLagrangianTransform->GetDisplacementField() );
+  jacobianDeterminantFilter->Update();
+
+  ScalarFieldType * logJacobianDeterminant = timeVaryingVelocityFieldSemiLagrangianTransform->GetLogJacobianDeterminant();
+  TEST_EXPECT_TRUE( logJacobianDeterminant != nullptr );
+
+  double maximumLogJacobianDeterminant = 0;
+  double maximumJacobianDeterminantError = 0;
+  itk::ImageRegionConstIteratorWithIndex< ScalarFieldType > logJacobianIt( logJacobianDeterminant, logJacobianDeterminant->GetLargestPossibleRegion() );
+  for( logJacobianIt.GoToBegin(); !logJacobianIt.IsAtEnd(); ++logJacobianIt )
+    {
+    const ScalarFieldType::IndexType index = logJacobianIt.GetIndex();
+    if( index[0] < 2 || index[1] < 2 || index[0] > 29 || index[1] > 29 ){ continue; }
+
+    const double jacobianDeterminant = jacobianDeterminantFilter->GetOutput()->GetPixel( index );
+    maximumLogJacobianDeterminant = std::max( maximumLogJacobianDeterminant, std::abs( logJacobianIt.Get() ) );
+    maximumJacobianDeterminantError = std::max( maximumJacobianDeterminantError,
+      std::abs( std::exp( logJacobianIt.Get() ) - jacobianDeterminant ) / jacobianDeterminant );
+    }
+
+  std::cout << "Maximum |log|D\phi||: " << maximumLogJacobianDeterminant << std::endl;
+  std::cout << "Maximum relative |D\phi| error: " << maximumJacobianDeterminantError << std::endl;
+  if( maximumLogJacobianDeterminant < 0.05 || maximumJacobianDeterminantError > 0.05 )
+    {
+    std::cerr << "Test failed!" << std::endl;
+    std::cerr << "exp(log|D\phi|) doesn't match the Jacobian determinant of the displacement field." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // Integrating the quantized velocity should stay within its reported error of the full-precision map
+  DisplacementFieldType::Pointer displacementField = timeVaryingVelocityFieldSemiLagrangianTransform->GetModifiableDisplacementField();
+  timeVaryingVelocityFieldSemiLagrangianTransform->UseQuantizedVelocityOn();
+  TRY_EXPECT_NO_EXCEPTION( timeVaryingVelocityFieldSemiLagrangianTransform->IntegrateVelocityField() );
+  TEST_EXPECT_TRUE( timeVaryingVelocityFieldSemiLagrangianTransform->GetQuantizedVelocityField() != nullptr );
+
+  const double maximumQuantizationError = timeVaryingVelocityFieldSemiLagrangianTransform->GetQuantizedVelocityField()->GetMaximumAbsoluteError();
+  double maximumQuantizedDisplacementError = 0;
+  itk::ImageRegionConstIteratorWithIndex< DisplacementFieldType > quantizedDisplacementIt( timeVaryingVelocityFieldSemiLagrangianTransform->GetDisplacementField(),
+    timeVaryingVelocityFieldSemiLagrangianTransform->GetDisplacementField()->GetLargestPossibleRegion() );
+  for( quantizedDisplacementIt.GoToBegin(); !quantizedDisplacementIt.IsAtEnd(); ++quantizedDisplacementIt )
+    {
+    const DisplacementFieldType::IndexType index = quantizedDisplacementIt.GetIndex();
+    if( index[0] < 2 || index[1] < 2 || index[0] > 29 || index[1] > 29 ){ continue; }
+
+    for( unsigned int i = 0; i < Dimension; i++ )
+      {
+      maximumQuantizedDisplacementError = std::max( maximumQuantizedDisplacementError,
+        std::abs( quantizedDisplacementIt.Get()[i] - displacementField->GetPixel( index )[i] ) );
+      }
+    }
+
+  std::cout << "Maximum velocity quantization error: " << maximumQuantizationError << std::endl;
+  std::cout << "Maximum quantized displacement error: " << maximumQuantizedDisplacementError << std::endl;
+  if( maximumQuantizedDisplacementError > 2 * maximumQuantizationError + 1e-9 )
+    {
+    std::cerr << "Test failed!" << std::endl;
+    std::cerr << "Integrating the quantized velocity moved the map by more than its quantization error." << std::endl;
+    return EXIT_FAILURE;
+    }
+  timeVaryingVelocityFieldSemiLagrangianTransform->UseQuantizedVelocityOff();
+
+  // Equal time bounds should give the identity with log|D\phi| = 0
+  timeVaryingVelocityFieldSemiLagrangianTransform->SetLowerTimeBound( 1.0 );
+  timeVaryingVelocityFieldSemiLagrangianTransform->SetUpperTimeBound( 1.0 );
+  TRY_EXPECT_NO_EXCEPTION( timeVaryingVelocityFieldSemiLagrangianTransform->IntegrateVelocityField() );
+
+  itk::ImageRegionConstIterator< DisplacementFieldType > displacementIt( timeVaryingVelocityFieldSemiLagrangianTransform->GetDisplacementField(),
+    timeVaryingVelocityFieldSemiLagrangianTransform->GetDisplacementField()->GetLargestPossibleRegion() );
+  itk::ImageRegionConstIterator< ScalarFieldType > identityLogJacobianIt( timeVaryingVelocityFieldSemiLagrangianTransform->GetLogJacobianDeterminant(),
+    timeVaryingVelocityFieldSemiLagrangianTransform->GetLogJacobianDeterminant()->GetLargestPossibleRegion() );
+  for( displacementIt.GoToBegin(), identityLogJacobianIt.GoToBegin(); !displacementIt.IsAtEnd(); ++displacementIt, ++identityLogJacobianIt )
+    {
+    if( displacementIt.Get().GetNorm() != 0 || identityLogJacobianIt.Get() != 0 )
+      {
+      std::cerr << "Test failed!" << std::endl;
+      std::cerr << "Equal time bounds didn't give the identity at " << displacementIt.GetIndex() << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
 
   std::cout << "Test finished." << std::endl;
   return EXIT_SUCCESS;